@@ -0,0 +1,102 @@
+#!/usr/bin/env bash
+
+# Build clox in a couple of configurations and time each of them on
+# the benchmark scripts in this directory.
+#
+# Usage (from the clox directory):
+#   bash bench/bench.sh
+#
+# The scripts (clox doesn't scan comments yet, so they are described here):
+# - fib.lox is call-heavy: naive recursive fibonacci, so almost every
+#   instruction is a call, a return or the arithmetic around them.
+# - loop.lox is loop-heavy: tight while / for loops over locals, which is
+#   dominated by instruction dispatch rather than calls or allocation.
+# - objects.lox is object-heavy: it creates lots of closures / upvalues
+#   and builds up a string by concatenation.
+# - alloc.lox is allocation-heavy: a million short-lived closures, each
+#   with an upvalue, so it mostly measures the allocator and the sweep.
+# - concat.lox is string-heavy: it builds 24KB strings one `+` at a time,
+#   so it mostly measures copying and hashing the intermediate strings.
+# - generational.lox keeps 200,000 closures alive while it makes a million
+#   short-lived ones; compare `--stats` with and without `--gc-nursery`
+#   or `--gc-slice`.
+# - mark.lox keeps a binary tree of 262,143 closures alive while it makes
+#   short-lived ones, so most of each collection is marking a tree, which
+#   splits up nicely between marking threads. At the end we run it with
+#   1 to 8 of them.
+#   Any of these can be compared with and without `--gc-sweep-thread`.
+# - upvalues.lox has a function with 50 captured locals make 200,000
+#   closures that each capture its first local, so it mostly measures
+#   finding an already open upvalue. It assigns each local once, so that
+#   the closures share them rather than copying their values.
+#
+# Note: unlike compile.sh this lets gcc drive the linker, so it works on
+# both macos and linux.
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+CLOX_DIR=$(dirname "$BENCH_DIR")
+BUILD_DIR=$(mktemp -d)
+trap 'rm -rf "$BUILD_DIR"' EXIT
+
+# Each config is "name:extra gcc flags". For threaded dispatch we turn off
+# the gcc passes that merge all the per-opcode `goto *` jumps back into a
+# single shared one, which would defeat the point.
+CONFIGS=(
+  "switch:-DFORCE_SWITCH_DISPATCH"
+  "threaded:-fno-gcse -fno-crossjumping"
+  "nan-boxing:-fno-gcse -fno-crossjumping -DNAN_BOXING"
+  "swiss:-fno-gcse -fno-crossjumping -DSWISS_TABLES"
+)
+
+for config in "${CONFIGS[@]}"; do
+  name=${config%%:*}
+  flags=${config#*:}
+  gcc -O2 $flags -pthread -o "$BUILD_DIR/clox-$name" "$CLOX_DIR"/*.c
+  # A tiny program reporting the size of the structs that scale with
+  # sizeof(Value), for comparing memory use across configs.
+  gcc $flags -I"$CLOX_DIR" -o "$BUILD_DIR/sizes-$name" -x c - <<'SIZES'
+#include <stdio.h>
+#include "vm.h"
+int main() {
+  printf("Value %zu, table slot %zu, VM %zu\n",
+         sizeof(Value), TABLE_SLOT_SIZE, sizeof(VM));
+  return 0;
+}
+SIZES
+done
+
+echo "=== sizes (bytes) ==="
+for config in "${CONFIGS[@]}"; do
+  name=${config%%:*}
+  printf "  %-10s %s\n" "$name" "$("$BUILD_DIR/sizes-$name")"
+done
+
+# table.c is a C microbenchmark for the hash table, linked against the
+# rest of clox; we run it for both table implementations.
+for table in "robin-hood:" "swiss:-DSWISS_TABLES"; do
+  name=${table%%:*}
+  flags=${table#*:}
+  echo "=== table.c ($name) ==="
+  gcc -O2 $flags -pthread -I"$CLOX_DIR" -o "$BUILD_DIR/table-bench-$name" \
+    "$BENCH_DIR/table.c" $(ls "$CLOX_DIR"/*.c | grep -v '/main\.c$')
+  "$BUILD_DIR/table-bench-$name" | sed 's/^/  /'
+done
+
+for script in "$BENCH_DIR"/*.lox; do
+  echo "=== $(basename "$script") ==="
+  for config in "${CONFIGS[@]}"; do
+    name=${config%%:*}
+    TIMEFORMAT="  $(printf "%-10s" "$name") %Rs"
+    time "$BUILD_DIR/clox-$name" "$script" > /dev/null
+  done
+done
+
+# Mark times only mean something up to the number of cores.
+echo "=== mark.lox (threaded) by --gc-threads ==="
+for threads in 1 2 4 8; do
+  printf "  %-10s %s\n" "$threads" "$("$BUILD_DIR/clox-threaded" --no-cache \
+    --stats --gc-threads=$threads "$BENCH_DIR/mark.lox" 2>&1 >/dev/null |
+    grep '^gc: mark ')"
+done
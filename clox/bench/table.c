@@ -0,0 +1,140 @@
+// Microbenchmark for table.c: get / set / delete throughput at a few load
+// factors. bench.sh builds it against the rest of clox (minus main.c).
+//
+// For each load factor we fill a table to that load and then time:
+// - get hit: looking up every key in the table
+// - get miss: looking up the same number of keys that aren't there
+// - set: overwriting every key's value
+// - delete + set: deleting every key and putting it straight back
+// - churn: deleting every key and inserting a different one in its place,
+//   which is what the intern table sees as strings die and new ones are
+//   made; then get miss again, to see whether churn made probing slower
+
+#include <stdio.h>
+#include <time.h>
+
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+
+#define CAPACITY (1 << 16)
+#define ROUNDS 20
+
+
+static ObjString* keys[CAPACITY];
+static ObjString* missingKeys[CAPACITY];
+static ObjString* otherKeys[CAPACITY];
+
+
+static double secondsNow() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+static void report(const char* name, double start, int operations) {
+  double seconds = secondsNow() - start;
+  printf("  %-14s %6.1f ns/op\n", name, seconds * 1e9 / operations);
+}
+
+
+static void benchLoad(double load) {
+  int count = (int)(CAPACITY * load);
+  Table table;
+  initTable(&table);
+  // The table doubles once it's 3/4 full (7/8 with SWISS_TABLES), so
+  // either way it ends up with a capacity of CAPACITY as long as load is
+  // in (0.4375, 0.75].
+  for (int i = 0; i < count; i++) {
+    tableSet(&table, keys[i], NUMBER_VAL(i));
+  }
+  printf("load %.2f (%d keys, capacity %d)\n",
+	 (double)count / table.capacity, count, table.capacity);
+
+  Value value;
+  int found = 0;
+  double start = secondsNow();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < count; i++) {
+      found += tableGet(&table, keys[i], &value);
+    }
+  }
+  report("get hit", start, ROUNDS * count);
+
+  start = secondsNow();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < count; i++) {
+      found += tableGet(&table, missingKeys[i], &value);
+    }
+  }
+  report("get miss", start, ROUNDS * count);
+
+  start = secondsNow();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < count; i++) {
+      tableSet(&table, keys[i], NUMBER_VAL(round));
+    }
+  }
+  report("set", start, ROUNDS * count);
+
+  start = secondsNow();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < count; i++) {
+      tableDelete(&table, keys[i]);
+      tableSet(&table, keys[i], NUMBER_VAL(i));
+    }
+  }
+  report("delete + set", start, ROUNDS * count);
+
+  // An even number of rounds, so that we end up with `keys` again.
+  start = secondsNow();
+  for (int round = 0; round < ROUNDS; round++) {
+    ObjString** from = round % 2 == 0 ? keys : otherKeys;
+    ObjString** to = round % 2 == 0 ? otherKeys : keys;
+    for (int i = 0; i < count; i++) {
+      tableDelete(&table, from[i]);
+      tableSet(&table, to[i], NUMBER_VAL(i));
+    }
+  }
+  report("churn", start, ROUNDS * count);
+
+  start = secondsNow();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < count; i++) {
+      found += tableGet(&table, missingKeys[i], &value);
+    }
+  }
+  report("get miss", start, ROUNDS * count);
+
+  if (found != ROUNDS * count || table.count != count) {
+    printf("  (table is broken: %d found, %d keys)\n", found, table.count);
+  }
+  freeTable(&table);
+}
+
+
+int main() {
+  // The keys are only reachable from C locals, so make sure the GC
+  // never runs.
+  initGC((size_t)-1, 2, false, 0, 0, 1, false);
+  initVM();
+  char buffer[32];
+  for (int i = 0; i < CAPACITY; i++) {
+    int length = snprintf(buffer, sizeof(buffer), "key%d", i);
+    keys[i] = createString(buffer, length);
+    length = snprintf(buffer, sizeof(buffer), "missing%d", i);
+    missingKeys[i] = createString(buffer, length);
+    length = snprintf(buffer, sizeof(buffer), "other%d", i);
+    otherKeys[i] = createString(buffer, length);
+  }
+  double loads[] = {0.45, 0.6, 0.74};
+  for (int i = 0; i < 3; i++) {
+    benchLoad(loads[i]);
+  }
+  freeVM();
+  return 0;
+}
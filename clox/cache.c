@@ -0,0 +1,396 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "chunk.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+#include "cache.h"
+
+
+/* File layout. Integers are in native byte order, since a cache is only
+   ever read back on the machine that wrote it.
+
+   header:
+     "LOXC", u32 version, u64 source hash, u64 source length
+     u32 global count, then each global's name as a string, in slot order
+   function (the top-level script; nested functions appear as constants):
+     u32 arity, u32 upvalue count, u32 max stack, string name (length -1 for the script)
+     u32 code count, u32 constant count
+     code bytes, padding to 4, then one i32 line per code byte
+     constants: a u8 tag and then either an f64, a string, or padding
+     to 4 followed by a function
+   string:
+     i32 length, then that many bytes
+
+   The padding is so that the line arrays, which we use in place, are
+   aligned (the mapping itself starts on a page boundary).
+
+   Upvalue descriptors need no special handling since they are operands
+   of OP_CLOSURE. Global slots need the header's name list, because the
+   bytecode refers to them by index: loading registers the names in order
+   so that they get the same slots they had when we compiled.
+*/
+
+
+// Bump this whenever the layout above or the OpCode enum changes.
+#define CACHE_VERSION 5
+
+static const char cacheMagic[4] = {'L', 'O', 'X', 'C'};
+
+typedef enum {
+  CACHE_NUMBER,
+  CACHE_STRING,
+  CACHE_FUNCTION,
+} CacheConstantTag;
+
+
+// The currently loaded cache, which has to stay mapped for as long as
+// its functions are alive.
+static void* mapping = NULL;
+static size_t mappingSize = 0;
+
+
+// FNV-1a, widened to 64 bits since a collision here means running
+// stale bytecode.
+static uint64_t hashSource(const char* source, size_t length) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)source[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+
+// Writing ------------------------------------------------------
+
+
+// Like the markstack, this buffer uses plain realloc: it has nothing to
+// do with the Lox heap and must not trigger a GC.
+typedef struct {
+  uint8_t* bytes;
+  size_t count;
+  size_t capacity;
+  bool ok;
+} Writer;
+
+
+static void writeBytes(Writer* writer, const void* data, size_t length) {
+  if (writer->capacity < writer->count + length) {
+    size_t capacity = writer->capacity < 256 ? 256 : writer->capacity;
+    while (capacity < writer->count + length) {
+      capacity *= 2;
+    }
+    uint8_t* bytes = (uint8_t*)realloc(writer->bytes, capacity);
+    if (bytes == NULL) {
+      writer->ok = false;
+      return;
+    }
+    writer->bytes = bytes;
+    writer->capacity = capacity;
+  }
+  memcpy(writer->bytes + writer->count, data, length);
+  writer->count += length;
+}
+
+
+static void writeU32(Writer* writer, uint32_t value) {
+  writeBytes(writer, &value, sizeof(value));
+}
+
+
+static void writePadding(Writer* writer) {
+  static const uint8_t zeros[4] = {0};
+  writeBytes(writer, zeros, (4 - writer->count % 4) % 4);
+}
+
+
+static void writeString(Writer* writer, ObjString* string) {
+  int32_t length = string == NULL ? -1 : string->length;
+  writeBytes(writer, &length, sizeof(length));
+  if (string != NULL) {
+    writeBytes(writer, string->chars, string->length);
+  }
+}
+
+
+static void writeFunction(Writer* writer, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  writeU32(writer, function->arity);
+  writeU32(writer, function->upvalueCount);
+  writeU32(writer, function->maxStack);
+  writeString(writer, function->name);
+  writeU32(writer, chunk->count);
+  writeU32(writer, chunk->constants.count);
+  writeBytes(writer, chunk->code, chunk->count);
+  writePadding(writer);
+  writeBytes(writer, chunk->lines, sizeof(int) * chunk->count);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    uint8_t tag;
+    if (IS_NUMBER(constant)) {
+      tag = CACHE_NUMBER;
+      writeBytes(writer, &tag, 1);
+      double number = AS_NUMBER(constant);
+      writeBytes(writer, &number, sizeof(number));
+    } else if (IS_STRING(constant)) {
+      tag = CACHE_STRING;
+      writeBytes(writer, &tag, 1);
+      writeString(writer, AS_STRING(constant));
+    } else if (IS_FUNCTION(constant)) {
+      tag = CACHE_FUNCTION;
+      writeBytes(writer, &tag, 1);
+      writePadding(writer);
+      writeFunction(writer, AS_FUNCTION(constant));
+    } else {
+      // The compiler never makes any other kind of constant.
+      writer->ok = false;
+    }
+  }
+}
+
+
+void writeBytecodeCache(const char* cache_path, const char* source,
+			ObjFunction* function) {
+  Writer writer = {NULL, 0, 0, true};
+  size_t length = strlen(source);
+  uint64_t hash = hashSource(source, length);
+  uint64_t source_length = length;
+  writeBytes(&writer, cacheMagic, sizeof(cacheMagic));
+  writeU32(&writer, CACHE_VERSION);
+  writeBytes(&writer, &hash, sizeof(hash));
+  writeBytes(&writer, &source_length, sizeof(source_length));
+  int global_count = vmGlobalCount();
+  writeU32(&writer, global_count);
+  for (int i = 0; i < global_count; i++) {
+    writeString(&writer, vmGlobalName(i));
+  }
+  writePadding(&writer);
+  writeFunction(&writer, function);
+
+  // Write to a temporary file and rename it into place, so that another
+  // process never maps a half-written cache.
+  if (writer.ok) {
+    size_t path_length = strlen(cache_path) + 32;
+    char* temp_path = (char*)malloc(path_length);
+    if (temp_path != NULL) {
+      snprintf(temp_path, path_length, "%s.%ld.tmp", cache_path, (long)getpid());
+      FILE* file = fopen(temp_path, "wb");
+      if (file != NULL) {
+	bool written = fwrite(writer.bytes, 1, writer.count, file) == writer.count;
+	if (fclose(file) == 0 && written) {
+	  written = rename(temp_path, cache_path) == 0;
+	}
+	if (!written) {
+	  remove(temp_path);
+	}
+      }
+      free(temp_path);
+    }
+  }
+  free(writer.bytes);
+}
+
+
+// Loading ------------------------------------------------------
+
+
+// Every read is bounds-checked, so that a truncated or corrupt file
+// makes us fall back to compiling rather than crash. We do trust the
+// bytecode itself, just as we trust the compiler's output.
+typedef struct {
+  uint8_t* start;
+  uint8_t* current;
+  uint8_t* end;
+  bool ok;
+} Reader;
+
+
+// Return a pointer to the next `length` bytes of the mapping.
+static uint8_t* readInPlace(Reader* reader, size_t length) {
+  if (!reader->ok || (size_t)(reader->end - reader->current) < length) {
+    reader->ok = false;
+    return NULL;
+  }
+  uint8_t* bytes = reader->current;
+  reader->current += length;
+  return bytes;
+}
+
+
+static void readBytes(Reader* reader, void* out, size_t length) {
+  uint8_t* bytes = readInPlace(reader, length);
+  if (bytes != NULL) {
+    memcpy(out, bytes, length);
+  } else {
+    memset(out, 0, length);
+  }
+}
+
+
+static uint32_t readU32(Reader* reader) {
+  uint32_t value;
+  readBytes(reader, &value, sizeof(value));
+  return value;
+}
+
+
+static void readPadding(Reader* reader) {
+  readInPlace(reader, (4 - (reader->current - reader->start) % 4) % 4);
+}
+
+
+// Returns NULL both for an error and for a missing name; check
+// reader->ok to tell them apart.
+static ObjString* readString(Reader* reader) {
+  int32_t length;
+  readBytes(reader, &length, sizeof(length));
+  if (!reader->ok || length < 0) {
+    return NULL;
+  }
+  uint8_t* chars = readInPlace(reader, length);
+  if (chars == NULL) {
+    return NULL;
+  }
+  return createString((const char*)chars, length);
+}
+
+
+static ObjFunction* readFunction(Reader* reader) {
+  ObjFunction* function = newFunction();
+  // Keep the function reachable while we allocate its name and constants
+  // (the constants are reachable through it, just like in the compiler).
+  push(OBJ_VAL(function));
+  function->arity = readU32(reader);
+  function->upvalueCount = readU32(reader);
+  function->maxStack = readU32(reader);
+  function->name = readString(reader);
+  if (function->name != NULL) {
+    writeBarrier((Obj*)function, OBJ_VAL(function->name));
+  }
+  uint32_t count = readU32(reader);
+  uint32_t constant_count = readU32(reader);
+  uint8_t* code = readInPlace(reader, count);
+  readPadding(reader);
+  int* lines = (int*)readInPlace(reader, sizeof(int) * (size_t)count);
+  if (reader->ok) {
+    // Use the mapped code and lines directly; capacity stays 0, which
+    // tells freeChunk that the chunk doesn't own them.
+    function->chunk.code = code;
+    function->chunk.lines = lines;
+    function->chunk.count = count;
+  }
+  for (uint32_t i = 0; reader->ok && i < constant_count; i++) {
+    uint8_t tag;
+    readBytes(reader, &tag, 1);
+    if (!reader->ok) {
+      break;
+    }
+    switch (tag) {
+    case CACHE_NUMBER: {
+      double number;
+      readBytes(reader, &number, sizeof(number));
+      addConstant(&function->chunk, NUMBER_VAL(number));
+      break;
+    }
+    case CACHE_STRING: {
+      ObjString* string = readString(reader);
+      if (string == NULL) {
+	reader->ok = false;
+	break;
+      }
+      addConstant(&function->chunk, OBJ_VAL(string));
+      writeBarrier((Obj*)function, OBJ_VAL(string));
+      break;
+    }
+    case CACHE_FUNCTION: {
+      readPadding(reader);
+      ObjFunction* nested = readFunction(reader);
+      if (nested != NULL) {
+	addConstant(&function->chunk, OBJ_VAL(nested));
+	writeBarrier((Obj*)function, OBJ_VAL(nested));
+      }
+      break;
+    }
+    default:
+      reader->ok = false;
+    }
+  }
+  pop();
+  return reader->ok ? function : NULL;
+}
+
+
+ObjFunction* loadBytecodeCache(const char* cache_path, const char* source) {
+  int fd = open(cache_path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  // Map privately and writably: quickening rewrites opcodes in place,
+  // and those writes must not end up in the file (the kernel copies the
+  // affected pages on write).
+  size_t size = (size_t)info.st_size;
+  void* bytes = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (bytes == MAP_FAILED) {
+    return NULL;
+  }
+
+  Reader reader = {(uint8_t*)bytes, (uint8_t*)bytes, (uint8_t*)bytes + size, true};
+  char magic[4];
+  readBytes(&reader, magic, sizeof(magic));
+  uint32_t version = readU32(&reader);
+  uint64_t hash, source_length;
+  readBytes(&reader, &hash, sizeof(hash));
+  readBytes(&reader, &source_length, sizeof(source_length));
+  size_t length = strlen(source);
+  if (!reader.ok ||
+      memcmp(magic, cacheMagic, sizeof(magic)) != 0 ||
+      version != CACHE_VERSION ||
+      source_length != length ||
+      hash != hashSource(source, length)) {
+    munmap(bytes, size);
+    return NULL;
+  }
+
+  uint32_t global_count = readU32(&reader);
+  for (uint32_t i = 0; reader.ok && i < global_count; i++) {
+    ObjString* name = readString(&reader);
+    if (name == NULL || vmGlobalSlot(name) != (int)i) {
+      reader.ok = false;
+    }
+  }
+  readPadding(&reader);
+  ObjFunction* function = reader.ok ? readFunction(&reader) : NULL;
+  if (function == NULL) {
+    // Anything we allocated along the way is garbage now, and freeChunk
+    // won't touch the mapped arrays, so it's safe to unmap.
+    munmap(bytes, size);
+    return NULL;
+  }
+  mapping = bytes;
+  mappingSize = size;
+  return function;
+}
+
+
+void freeBytecodeCache() {
+  if (mapping != NULL) {
+    munmap(mapping, mappingSize);
+    mapping = NULL;
+    mappingSize = 0;
+  }
+}
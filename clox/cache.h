@@ -0,0 +1,29 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "object.h"
+
+
+// Bytecode cache: compiled scripts are saved next to the source (the
+// cache for `foo.lox` is `foo.loxc`) and loaded from there on later runs,
+// skipping the scanner and compiler entirely.
+//
+// The cache is keyed on a hash of the source, so editing the script
+// invalidates it. Loading maps the file into memory and uses the code
+// and line arrays in place; everything else (functions, strings,
+// constant arrays) is allocated on the heap as usual.
+
+
+// Returns the cached top-level function for `source`, or NULL if there
+// is no valid cache at `cache_path`.
+ObjFunction* loadBytecodeCache(const char* cache_path, const char* source);
+
+// Best effort: if the cache can't be written, we just carry on.
+void writeBytecodeCache(const char* cache_path, const char* source,
+			ObjFunction* function);
+
+// Unmap any loaded cache. Only safe once no functions from it are live,
+// i.e. after freeVM().
+void freeBytecodeCache();
+
+#endif
@@ -20,14 +20,9 @@ void initChunk(Chunk* chunk) {
 }
 
 
-#include <stdio.h>
-
-
 int addConstant(Chunk* chunk, Value value) {
   push(value);
-  printf("pushed value "); printValue(value); printf("\n");
   writeValueArray(&chunk->constants, value);
-  printf("wrote value "); printValue(value); printf("\n");
   pop();
   return chunk->constants.count - 1;
 }
@@ -48,7 +43,11 @@ void writeChunk(Chunk* chunk, uint8_t code_byte, int line) {
 
 void freeChunk(Chunk* chunk) {
   freeValueArray(&chunk->constants);
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  // (capacity 0 means there's nothing to free, or the arrays are
+  // borrowed from a mapped bytecode cache)
+  if (chunk->capacity > 0) {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  }
   initChunk(chunk);
 }
@@ -5,41 +5,100 @@
 #include "value.h"
 
 
+// Opcodes with a _NUM / _STR suffix are never emitted by the compiler.
+// They are "quickened" versions of a generic opcode that the vm writes
+// over the original in place once it has seen what operand types a site
+// gets, and that it rewrites back to the generic opcode if those types
+// ever change (see QUICKEN / DEOPTIMIZE in vm.c).
+//
+// The compiler also emits a few superinstructions, which fuse sequences
+// that show up a lot in `--stats` opcode-pair counts into one dispatch:
+// - OP_ADD_LOCALS a b            = OP_GET_LOCAL a; OP_GET_LOCAL b; OP_ADD
+// - OP_JUMP_LOCAL_NOT_LESS_CONST a c offset
+//                                = OP_GET_LOCAL a; OP_CONSTANT c; OP_LESS;
+//                                  OP_JUMP_IF_FALSE offset; OP_POP
+//                                  (used for if / loop conditions, so
+//                                  neither branch has a condition to pop)
+// - OP_RETURN_CONSTANT c         = OP_CONSTANT c; OP_RETURN
+// - OP_SET_LOCAL_POP a           = OP_SET_LOCAL a; OP_POP
+// - OP_TAIL_CALL n               = OP_CALL n; OP_RETURN
+//                                  (except that the callee takes over
+//                                  the caller's frame, see vm.c)
+//
+// Constant and global slot operands are one byte, but each opcode taking
+// one has a _LONG version whose operand is 3 bytes (high byte first),
+// which the compiler uses once a chunk has more than 256 constants or the
+// vm has more than 256 globals.
 typedef enum {
   OP_ADD,
+  OP_ADD_LOCALS,
+  OP_ADD_NUM,
+  OP_ADD_STR,
   OP_CALL,
   OP_CONSTANT,
+  OP_CONSTANT_LONG,
   OP_CLOSURE,
+  OP_CLOSURE_LONG,
   OP_CLOSE_UPVALUE,
   OP_DIVIDE,
+  OP_DIVIDE_NUM,
   OP_DEFINE_GLOBAL,
+  OP_DEFINE_GLOBAL_LONG,
   OP_EQUAL,
   OP_FALSE,
   OP_JUMP,
   OP_JUMP_IF_FALSE,
+  OP_JUMP_LOCAL_NOT_LESS_CONST,
   OP_GET_GLOBAL,
+  OP_GET_GLOBAL_LONG,
   OP_GET_LOCAL,
   OP_GET_UPVALUE,
   OP_GREATER,
+  OP_GREATER_NUM,
   OP_LESS,
+  OP_LESS_NUM,
   OP_LOOP,
   OP_MULTIPLY,
+  OP_MULTIPLY_NUM,
   OP_NEGATE,
   OP_NIL,
   OP_NOT,
   OP_POP,
   OP_PRINT,
   OP_RETURN,
+  OP_RETURN_CONSTANT,
   OP_SET_GLOBAL,
+  OP_SET_GLOBAL_LONG,
   OP_SET_LOCAL,
+  OP_SET_LOCAL_POP,
   OP_SET_UPVALUE,
   OP_SUBTRACT,
+  OP_SUBTRACT_NUM,
+  OP_TAIL_CALL,
   OP_TRUE,
 } OpCode;
 
 
+// OP_CLOSURE is followed by two bytes for each of the function's
+// upvalues: one of these, and then the index of the local or of the
+// enclosing closure's upvalue that it captures.
+typedef enum {
+  CAPTURE_UPVALUE,      // share the enclosing closure's upvalue
+  CAPTURE_LOCAL,        // share the local, through an ObjUpvalue
+  CAPTURE_LOCAL_VALUE,  // copy the local's value (it's never assigned)
+} CaptureKind;
+
+
+// The largest operand of a _LONG opcode.
+#define UINT24_MAX 0xffffff
+
+
 /* Bytecodes can be opcodes, but they can also be other uint8 values, e.g.
-   immediate values for arithmetic codes. */
+   immediate values for arithmetic codes.
+
+   A chunk loaded from the bytecode cache (see cache.h) has its code and
+   lines pointing into the mapped cache file, and a capacity of 0 to mark
+   that it doesn't own them. */
 typedef struct {
   int count;
   int capacity;
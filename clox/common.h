@@ -12,14 +12,27 @@
 #define PRINT_DEBUG(...) ;
 #endif
 
-#define DEBUG_TRACE_EXECUTION
-#define DEBUG_PRINT_CODE
+// run() uses threaded (computed-goto) dispatch whenever the compiler
+// supports the "labels as values" extension, which GCC and Clang both
+// do. Build with -DFORCE_SWITCH_DISPATCH to get the portable switch loop.
+#if defined(__GNUC__) && !defined(FORCE_SWITCH_DISPATCH)
+#define USE_THREADED_DISPATCH
+#endif
 
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 
-#define DEBUG_STRESS_GC
+// Represent Value as a NaN-boxed uint64_t rather than a tagged union
+// (see value.h). Off by default; build with -DNAN_BOXING to turn it on.
+// #define NAN_BOXING
+
+
+// Use the SwissTable-style Table in table_swiss.c instead of the Robin
+// Hood one in table.c. Off by default; build with -DSWISS_TABLES.
+// #define SWISS_TABLES
+
+
 // #define DEBUG_LOG_GC
 
 #ifdef DEBUG_LOG_GC
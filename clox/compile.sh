@@ -13,16 +13,20 @@ gcc -g -c -o memory.o memory.c
 gcc -g -c -o value.o value.c
 gcc -g -c -o object.o object.c
 gcc -g -c -o table.o table.c
+gcc -g -c -o table_swiss.o table_swiss.c
 gcc -g -c -o chunk.o chunk.c
 gcc -g -c -o vm.o vm.c
 gcc -g -c -o debug.o debug.c
 gcc -g -c -o scanner.o scanner.c
 gcc -g -c -o compiler.o compiler.c
+gcc -g -c -o cache.o cache.c
+gcc -g -c -o heap.o heap.c
+gcc -g -c -o parallel_mark.o parallel_mark.c
 gcc -g -c -o main.o main.c
 
 ld \
 	-macos_version_min 13.3.1 -arch arm64 \
 	-L$(xcode-select -p)/SDKs/MacOSX.sdk/usr/lib -lSystem \
 	-o clox.exe \
-	main.o memory.o object.o value.o table.o chunk.o vm.o \
-	scanner.o compiler.o debug.o
+	main.o memory.o object.o value.o table.o table_swiss.o chunk.o vm.o \
+	scanner.o compiler.o debug.o cache.o heap.o parallel_mark.o
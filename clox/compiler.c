@@ -7,10 +7,9 @@
 #include "object.h"
 #include "value.h"
 #include "chunk.h"
-
-#ifdef DEBUG_PRINT_CODE
 #include "debug.h"
-#endif
+#include "vm.h"
+#include "memory.h"
 
 #include "compiler.h"
 
@@ -21,6 +20,10 @@ typedef struct{
   Token name;
   int depth;
   bool isCaptured;
+  // Whether captures have to share the variable through an ObjUpvalue,
+  // because it gets assigned to after its declaration. Otherwise they
+  // can copy its value (see CaptureKind in chunk.h).
+  bool needsUpvalue;
 } Local;
 
 
@@ -37,6 +40,35 @@ typedef struct {
 } StaticUpvalue;
 
 
+// An index from constant values to their slot in a chunk's constant
+// pool, so that repeated literals share a slot instead of each taking a
+// new one. Only numbers and strings go in here; every function constant
+// is distinct anyway.
+//
+// This is a small open-addressing hash table like table.c, except that
+// keys are Values (strings are interned, so comparing them by pointer is
+// fine). Empty entries have an index of -1.
+typedef struct {
+  Value key;
+  int index;
+} ConstantEntry;
+
+
+typedef struct {
+  int count;
+  int capacity;
+  ConstantEntry* entries;
+} ConstantIndex;
+
+
+// An OP_CLOSURE operand that captures a local by value, which has to
+// become a CAPTURE_LOCAL if we later find an assignment to that local.
+typedef struct {
+  int local;
+  int offset;  // of the CaptureKind byte in the chunk
+} ValueCapture;
+
+
 // Just a note about Local.isCaptured versus StaticUpvalue:
 //
 // - StaticUpvalues are associated with the compilers of functions
@@ -76,6 +108,24 @@ typedef struct Compiler {
   struct Compiler* enclosing;
   // This is only actually used in nested functions.
   StaticUpvalue upvalues[UINT8_COUNT];
+  // Dedup index for function->chunk.constants (freed in endCompiler)
+  ConstantIndex constantIndex;
+  // The by-value captures of locals still in scope (freed in
+  // endCompiler)
+  ValueCapture* valueCaptures;
+  int valueCaptureCount;
+  int valueCaptureCapacity;
+  // Peephole state for superinstructions (see chunk.h): the offsets at
+  // which the most recent instructions of interest start, or -1. We
+  // only fuse a sequence if it sits at the very end of the chunk and
+  // no jump lands inside it, hence also tracking lastJumpTarget.
+  int lastJumpTarget;
+  int lastGetLocal;
+  int previousGetLocal;
+  int lastConstant;
+  int lastLess;
+  int lastSetLocal;
+  int lastCall;
 } Compiler;
 
 
@@ -223,22 +273,150 @@ static void emit2Bytes(uint8_t byte0, uint8_t byte1) {
 }
 
 
-static uint8_t makeConstant(Value value) {
+/* Emit an instruction whose operand is a constant or global slot index,
+   using the 3-byte operand form `long_op` if it doesn't fit in a byte. */
+static void emitIndexed(uint8_t op, uint8_t long_op, int index) {
+  if (index <= UINT8_MAX) {
+    emit2Bytes(op, (uint8_t)index);
+  } else {
+    emitByte(long_op);
+    emitByte((index >> 16) & 0xff);
+    emitByte((index >> 8) & 0xff);
+    emitByte(index & 0xff);
+  }
+}
+
+
+static uint32_t hashConstant(Value value) {
+  if (IS_STRING(value)) {
+    return AS_STRING(value)->hash;
+  }
+  // Hash numbers by their bits, folding the high half into the low half.
+  double number = AS_NUMBER(value);
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  return (uint32_t)(bits ^ (bits >> 32));
+}
+
+
+static bool sameConstant(Value a, Value b) {
+  if (IS_STRING(a) || IS_STRING(b)) {
+    return IS_STRING(a) && IS_STRING(b) && AS_STRING(a) == AS_STRING(b);
+  }
+  // Compare numbers bitwise rather than with ==, which would merge
+  // 0 and -0.
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  return memcmp(&x, &y, sizeof(double)) == 0;
+}
+
+
+static ConstantEntry* findConstantEntry(ConstantEntry* entries, int capacity,
+					Value value) {
+  uint32_t index = hashConstant(value) % capacity;
+  for (;;) {
+    ConstantEntry* entry = &entries[index];
+    if (entry->index == -1 || sameConstant(entry->key, value)) {
+      return entry;
+    }
+    index = (index + 1) % capacity;
+  }
+}
+
+
+static void growConstantIndex(ConstantIndex* constants) {
+  int capacity = GROW_CAPACITY(constants->capacity);
+  ConstantEntry* entries = ALLOCATE(ConstantEntry, capacity);
+  for (int i = 0; i < capacity; i++) {
+    entries[i].key = NIL_VAL;
+    entries[i].index = -1;
+  }
+  for (int i = 0; i < constants->capacity; i++) {
+    ConstantEntry* source = &constants->entries[i];
+    if (source->index != -1) {
+      *findConstantEntry(entries, capacity, source->key) = *source;
+    }
+  }
+  FREE_ARRAY(ConstantEntry, constants->entries, constants->capacity);
+  constants->entries = entries;
+  constants->capacity = capacity;
+}
+
+
+static int makeConstant(Value value) {
+  // Reuse an existing slot for numbers and strings we've seen before.
+  ConstantIndex* constants = &currentCompiler->constantIndex;
+  bool dedup = IS_NUMBER(value) || IS_STRING(value);
+  if (dedup && constants->count > 0) {
+    ConstantEntry* entry = findConstantEntry(constants->entries,
+					     constants->capacity, value);
+    if (entry->index != -1) {
+      return entry->index;
+    }
+  }
+
   int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX) {
+  // The function may have survived a collection while we compiled it.
+  writeBarrier((Obj*)currentCompiler->function, value);
+  if (constant > UINT24_MAX) {
     // Recall that constants is a dynamic array, so there's no
     // problem with memory safety here; the reason we have to error
-    // is that we broke our limit on byte size, not that we ran out
+    // is that we broke our limit on operand size, not that we ran out
     // of space for constants.
     errorAtPrevious("Too many constants in one chunk");
     return 0;
   }
-  return (uint8_t)constant;
+  if (dedup) {
+    // (growing can GC, but the value is already safe in the chunk)
+    if (constants->count + 1 > constants->capacity * 0.75) {
+      growConstantIndex(constants);
+    }
+    ConstantEntry* entry = findConstantEntry(constants->entries,
+					     constants->capacity, value);
+    entry->key = value;
+    entry->index = constant;
+    constants->count++;
+  }
+  return constant;
 }
 
 
 static void emitConstant(Value value) {
-  emit2Bytes(OP_CONSTANT, makeConstant(value));
+  int constant = makeConstant(value);
+  // (only the one-byte form takes part in superinstructions)
+  currentCompiler->lastConstant = constant <= UINT8_MAX ? currentChunk()->count : -1;
+  emitIndexed(OP_CONSTANT, OP_CONSTANT_LONG, constant);
+}
+
+
+// Superinstruction peephole helpers ------------------------------
+
+
+static void resetPeephole() {
+  currentCompiler->lastGetLocal = -1;
+  currentCompiler->previousGetLocal = -1;
+  currentCompiler->lastConstant = -1;
+  currentCompiler->lastLess = -1;
+  currentCompiler->lastSetLocal = -1;
+  currentCompiler->lastCall = -1;
+}
+
+
+/* Record that some jump lands at the current end of the chunk, which
+   means whatever comes before it must not be fused with what comes
+   after. Returns the offset, for use as a loop start. */
+static int markJumpTarget() {
+  currentCompiler->lastJumpTarget = currentChunk()->count;
+  return currentChunk()->count;
+}
+
+
+/* Whether the instruction recorded at `start` is `length` bytes from
+   the end of the chunk, with no jump landing after its first byte. */
+static bool canFuse(int start, int length) {
+  return (start != -1 &&
+          start == currentChunk()->count - length &&
+          currentCompiler->lastJumpTarget <= start);
 }
 
 
@@ -260,7 +438,7 @@ static void emitLoop(int loop_start_index) {
   // which we will have already read by the time we actually jump.
   int offset = currentChunk()->count - loop_start_index + 2;
   uint8_t lower_address_byte = offset & 0xff;
-  uint8_t upper_address_byte = (offset << 8) & 0xff;
+  uint8_t upper_address_byte = (offset >> 8) & 0xff;
   emitByte(upper_address_byte);
   emitByte(lower_address_byte);
 }
@@ -272,18 +450,163 @@ static void patchJump(int byte_after_opcode) {
   // instruction (i.e. currentChunk->count) *relative* to
   // byte_after_opcode.
   int byte_after_address = byte_after_opcode + 2;
-  int offset = currentChunk()->count - byte_after_address;
+  int offset = markJumpTarget() - byte_after_address;
   if (offset > UINT16_MAX) {
     errorAtPrevious("Too big a block in control flow - 16-bit overflow.");
   }
   // Patch the jump address; do a bit of bit manipulation here to
   // spread the 16-bit offset across 2 bytes.
   uint8_t lower_address_byte = offset & 0xff;
-  uint8_t upper_address_byte = (offset << 8) & 0xff;
+  uint8_t upper_address_byte = (offset >> 8) & 0xff;
   currentChunk()->code[byte_after_opcode] = upper_address_byte;
   currentChunk()->code[byte_after_opcode + 1] = lower_address_byte;
 }
-  
+
+
+// Stack depth ---------------------------------------------
+
+
+/* Rather than keep count of the stack height as we emit code, we work it
+   out from the finished chunk: the peephole rewrites above change what
+   was emitted after the fact, and an if / else pops its condition once on
+   each branch, so the height doesn't just follow emission order.
+
+   Every jump except OP_LOOP goes forward, and a loop goes back to code we
+   have already seen at the same height, so one pass in code order is
+   enough: we note the height at each forward jump's target, and pick it
+   up from there once we get to it. Code that only follows an
+   unconditional jump or a return, and that nothing jumps to, is dead and
+   doesn't count. */
+
+
+// How the instruction at `offset` changes the stack height; sets
+// `*length` to its length in bytes.
+static int stackEffect(Chunk* chunk, int offset, int* length) {
+  uint8_t* code = &chunk->code[offset];
+  switch (code[0]) {
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG: {
+    int index = code[0] == OP_CLOSURE ? code[1] :
+      (code[1] << 16) | (code[2] << 8) | code[3];
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[index]);
+    *length = (code[0] == OP_CLOSURE ? 2 : 4) + 2 * function->upvalueCount;
+    return 1;
+  }
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    *length = 2;
+    return -code[1];
+  case OP_CONSTANT:
+  case OP_GET_GLOBAL:
+  case OP_GET_LOCAL:
+  case OP_GET_UPVALUE:
+    *length = 2;
+    return 1;
+  case OP_CONSTANT_LONG:
+  case OP_GET_GLOBAL_LONG:
+    *length = 4;
+    return 1;
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_LOCAL_POP:
+    *length = 2;
+    return -1;
+  case OP_DEFINE_GLOBAL_LONG:
+    *length = 4;
+    return -1;
+  case OP_SET_GLOBAL:
+  case OP_SET_LOCAL:
+  case OP_SET_UPVALUE:
+    *length = 2;
+    return 0;
+  case OP_SET_GLOBAL_LONG:
+    *length = 4;
+    return 0;
+  case OP_ADD_LOCALS:
+    *length = 3;
+    return 1;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+    *length = 3;
+    return 0;
+  case OP_JUMP_LOCAL_NOT_LESS_CONST:
+    *length = 5;
+    return 0;
+  case OP_RETURN_CONSTANT:
+    // It pushes the constant and then returns it.
+    *length = 2;
+    return 1;
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+    *length = 1;
+    return 1;
+  case OP_NEGATE:
+  case OP_NOT:
+  case OP_RETURN:
+    *length = 1;
+    return 0;
+  default:
+    // The binary operators, OP_POP, OP_PRINT and OP_CLOSE_UPVALUE.
+    *length = 1;
+    return -1;
+  }
+}
+
+
+// The most stack slots a call to `function` can use, counting the callee
+// and arguments in the slots it starts with.
+static int maxStackDepth(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  // The height at each jump target, or -1.
+  int* heights = ALLOCATE(int, chunk->count + 1);
+  for (int i = 0; i <= chunk->count; i++) {
+    heights[i] = -1;
+  }
+  int height = 1 + function->arity;
+  int max_height = height;
+  bool reachable = true;
+  int length;
+  for (int offset = 0; offset < chunk->count; offset += length) {
+    if (heights[offset] >= 0) {
+      height = heights[offset];
+      reachable = true;
+    }
+    int effect = stackEffect(chunk, offset, &length);
+    if (!reachable) {
+      continue;
+    }
+    height += effect;
+    if (height > max_height) {
+      max_height = height;
+    }
+    uint8_t* code = &chunk->code[offset];
+    switch (code[0]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_LOCAL_NOT_LESS_CONST: {
+      int target = offset + length + ((code[length - 2] << 8) | code[length - 1]);
+      if (target <= chunk->count) {
+	heights[target] = height;
+      }
+      if (code[0] == OP_JUMP) {
+	reachable = false;
+      }
+      break;
+    }
+    case OP_LOOP:
+    case OP_RETURN:
+    case OP_RETURN_CONSTANT:
+    case OP_TAIL_CALL:
+      reachable = false;
+      break;
+    }
+  }
+  FREE_ARRAY(int, heights, chunk->count + 1);
+  return max_height;
+}
+
+
 
 // Compiler initialization + end (used in every function) --------
 
@@ -294,20 +617,31 @@ void initCompiler(Compiler* compiler, FunctionType type) {
   compiler->type = type;
   compiler->function = newFunction();
   compiler->enclosing = currentCompiler;
+  compiler->lastJumpTarget = 0;
+  compiler->constantIndex.count = 0;
+  compiler->constantIndex.capacity = 0;
+  compiler->constantIndex.entries = NULL;
+  compiler->valueCaptures = NULL;
+  compiler->valueCaptureCount = 0;
+  compiler->valueCaptureCapacity = 0;
   // allocate one placeholder local at stack slot 0, which
   // we need to reserve for method calls (we will bind "this"
   // to stack slot 0 in bound method).
   Local* local = &compiler->locals[compiler->localCount++];
   local->depth = 0;
   local->isCaptured = false;
+  local->needsUpvalue = false;
   local->name.start = "";
   local->name.length = 0;
   // Set the current compiler global
   currentCompiler = compiler;
+  resetPeephole();
   // Grab the function name based on the current token if not top-level
   if (type != SCRIPT_TYPE) {
     compiler->function->name = createString(parser.previous.start,
 					    parser.previous.length);
+    writeBarrier((Obj*)compiler->function,
+		 OBJ_VAL(compiler->function->name));
   }
 }
 
@@ -315,14 +649,17 @@ void initCompiler(Compiler* compiler, FunctionType type) {
 static ObjFunction* endCompiler() {
   emit2Bytes(OP_NIL, OP_RETURN);
   ObjFunction* function = currentCompiler->function;
-
-  // if in debug mode, print the bytecode
-#ifdef DEBUG_PRINT_CODE
-  const char* name = function->name != NULL ? function->name->chars : "<script>";
-  if (!parser.hadError) {
+  ConstantIndex* constants = &currentCompiler->constantIndex;
+  FREE_ARRAY(ConstantEntry, constants->entries, constants->capacity);
+  FREE_ARRAY(ValueCapture, currentCompiler->valueCaptures,
+	     currentCompiler->valueCaptureCapacity);
+  function->maxStack = maxStackDepth(function);
+
+  // if requested (--dump-bytecode), print the bytecode
+  if (debugPrintCode && !parser.hadError) {
+    const char* name = function->name != NULL ? function->name->chars : "<script>";
     disassembleChunk(currentChunk(), name);
   }
-#endif
 
   // pop back to the parent compiler (NULL if this is already
   // top-level, otherwise the enclosing scope after a function).
@@ -591,8 +928,16 @@ static bool identifiersEqual(Token* a, Token* b) {
 }
 
 
-static uint8_t identifierConstant(Token* name) {
-  return makeConstant(OBJ_VAL(createString(name->start, name->length)));
+/* Resolve a global name to its slot in vm.globals (see vm.h). Unlike
+   locals and upvalues, globals are resolved by name only, so using a
+   global before its declaration (e.g. in a function body) is fine. */
+static int globalSlot(Token* name) {
+  int slot = vmGlobalSlot(createString(name->start, name->length));
+  if (slot > UINT24_MAX) {
+    errorAtPrevious("Too many global variables.");
+    return 0;
+  }
+  return slot;
 }
 
 
@@ -635,6 +980,16 @@ static void binary(bool canAssign) {
 
   switch (operator_type) {
   case TOKEN_PLUS:
+    if (canFuse(currentCompiler->previousGetLocal, 4) &&
+        canFuse(currentCompiler->lastGetLocal, 2)) {
+      // OP_GET_LOCAL a; OP_GET_LOCAL b => OP_ADD_LOCALS a b
+      Chunk* chunk = currentChunk();
+      chunk->code[chunk->count - 4] = OP_ADD_LOCALS;
+      chunk->code[chunk->count - 2] = chunk->code[chunk->count - 1];
+      chunk->count--;
+      resetPeephole();
+      break;
+    }
     emitByte(OP_ADD);
     break;
   case TOKEN_MINUS:
@@ -653,6 +1008,7 @@ static void binary(bool canAssign) {
     emit2Bytes(OP_EQUAL, OP_NOT);
     break;
   case TOKEN_LESS:
+    currentCompiler->lastLess = currentChunk()->count;
     emitByte(OP_LESS);
     break;
   case TOKEN_GREATER:
@@ -784,6 +1140,86 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
 }
 
 
+/* Captures and assignment.
+
+   A variable that's never assigned to after its declaration always has
+   the value it was declared with, so a closure can just copy that value
+   rather than share the variable through an ObjUpvalue: no allocation,
+   no open upvalue, and no OP_CLOSE_UPVALUE at the end of its scope.
+
+   We compile in one pass, though, so when we emit an OP_CLOSURE we may
+   not have seen every assignment yet. Captures of a variable with no
+   assignment so far are by value, and we remember where their operands
+   are; the first assignment turns them all into shared captures. (Note
+   that an assignment earlier in the source can still run later, in a
+   loop, which is why we go by "any assignment" rather than "any
+   assignment after the capture".)
+*/
+
+
+// Some code assigns to this local: make all of its captures share it.
+static void localNeedsUpvalue(Compiler* compiler, int local) {
+  if (compiler->locals[local].needsUpvalue) {
+    return;
+  }
+  compiler->locals[local].needsUpvalue = true;
+  Chunk* chunk = &compiler->function->chunk;
+  for (int i = 0; i < compiler->valueCaptureCount; i++) {
+    if (compiler->valueCaptures[i].local == local) {
+      chunk->code[compiler->valueCaptures[i].offset] = CAPTURE_LOCAL;
+    }
+  }
+}
+
+
+// The same, for a variable that `compiler` reaches through its upvalue
+// `index`: follow that up to the function where it's a local.
+static void upvalueNeedsUpvalue(Compiler* compiler, int index) {
+  StaticUpvalue* upvalue = &compiler->upvalues[index];
+  if (upvalue->isLocal) {
+    localNeedsUpvalue(compiler->enclosing, upvalue->index);
+  } else {
+    upvalueNeedsUpvalue(compiler->enclosing, upvalue->index);
+  }
+}
+
+
+// Emit the operands of an OP_CLOSURE for a function whose compiler is
+// `function_compiler`. `self` is the local the closure is about to be
+// stored in, if any: that one has to be shared, since the closure exists
+// before the variable has its value.
+static void emitCaptures(Compiler* function_compiler, int self) {
+  for (int i = 0; i < function_compiler->function->upvalueCount; i++) {
+    StaticUpvalue* upvalue = &function_compiler->upvalues[i];
+    uint8_t kind = CAPTURE_UPVALUE;
+    if (upvalue->isLocal) {
+      if (upvalue->index == self) {
+	localNeedsUpvalue(currentCompiler, self);
+      }
+      if (currentCompiler->locals[upvalue->index].needsUpvalue) {
+	kind = CAPTURE_LOCAL;
+      } else {
+	kind = CAPTURE_LOCAL_VALUE;
+	if (currentCompiler->valueCaptureCapacity <
+	    currentCompiler->valueCaptureCount + 1) {
+	  int old_capacity = currentCompiler->valueCaptureCapacity;
+	  currentCompiler->valueCaptureCapacity = GROW_CAPACITY(old_capacity);
+	  currentCompiler->valueCaptures = GROW_ARRAY(
+	      ValueCapture, currentCompiler->valueCaptures,
+	      old_capacity, currentCompiler->valueCaptureCapacity);
+	}
+	ValueCapture* capture =
+	  &currentCompiler->valueCaptures[currentCompiler->valueCaptureCount++];
+	capture->local = upvalue->index;
+	capture->offset = currentChunk()->count;
+      }
+    }
+    emitByte(kind);
+    emitByte(upvalue->index);
+  }
+}
+
+
 /* `canAssign` is a precedence-checking hack, specifically needed
    because we can't treat `=` as a Pratt infix operator...
 
@@ -797,7 +1233,9 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
      the expression and add it to the stack.
 */
 static void namedVariable(Token* name, bool canAssign) {
-  uint8_t getOp, setOp, arg;
+  uint8_t getOp, setOp;
+  uint8_t getLongOp = 0, setLongOp = 0;  // (only globals can need these)
+  int arg;
   // Determine whether to use a local (which means *same* function!),
   // upvalue (~= nonlocal), or global scope.
   //
@@ -805,28 +1243,42 @@ static void namedVariable(Token* name, bool canAssign) {
   // things:
   // - for a local, it's just an offset compared to the stack frame
   // - for an upvalue, it's an index into a special upvalues structure
-  // - for a global, it's an index into constants
+  // - for a global, it's a slot index into vm.globals
   int found_index = resolveLocal(currentCompiler, name);
   if (found_index != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
-    arg = (uint8_t)found_index;
+    arg = found_index;
   } else if ((found_index = resolveUpvalue(currentCompiler, name)) != -1) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
-    arg = (uint8_t)found_index;
+    arg = found_index;
  } else {
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
-    arg = identifierConstant(name);
+    getLongOp = OP_GET_GLOBAL_LONG;
+    setLongOp = OP_SET_GLOBAL_LONG;
+    arg = globalSlot(name);
   }
 
   // For bare variables, we can decide get vs set with a simple match
   if (canAssign && match(TOKEN_EQUAL)) {
+    if (setOp == OP_SET_LOCAL) {
+      localNeedsUpvalue(currentCompiler, arg);
+    } else if (setOp == OP_SET_UPVALUE) {
+      upvalueNeedsUpvalue(currentCompiler, arg);
+    }
     expression();  // evaluate the assignment RHS, put it on the stack
-    emit2Bytes(setOp, arg);  // (it will stay on the stack)
+    if (setOp == OP_SET_LOCAL) {
+      currentCompiler->lastSetLocal = currentChunk()->count;
+    }
+    emitIndexed(setOp, setLongOp, arg);  // (it will stay on the stack)
   } else {
-    emit2Bytes(getOp, arg);
+    if (getOp == OP_GET_LOCAL) {
+      currentCompiler->previousGetLocal = currentCompiler->lastGetLocal;
+      currentCompiler->lastGetLocal = currentChunk()->count;
+    }
+    emitIndexed(getOp, getLongOp, arg);
   }
 }
 
@@ -857,6 +1309,7 @@ static void call(bool canAssign) {
   // At this point, the top of the stack is the function followed by
   // arg_count arguments. We need the arg count to find the function,
   // and also to know where to set the frame pointer.
+  currentCompiler->lastCall = currentChunk()->count;
   emit2Bytes(OP_CALL, arg_count);
 }
 
@@ -918,10 +1371,22 @@ static void expression() {
 }
 
 
+/* Pop the value of an expression statement. This is where an
+   assignment to a local turns into OP_SET_LOCAL_POP. */
+static void emitStatementPop() {
+  if (canFuse(currentCompiler->lastSetLocal, 2)) {
+    currentChunk()->code[currentChunk()->count - 2] = OP_SET_LOCAL_POP;
+    resetPeephole();
+    return;
+  }
+  emitByte(OP_POP);
+}
+
+
 static void expressionStatement() {
   expression();
   consume(TOKEN_SEMICOLON, "Expect ';' after expression");
-  emitByte(OP_POP);
+  emitStatementPop();
 }
 
 
@@ -942,6 +1407,19 @@ static void returnStatement() {
     expression();
   }
   consume(TOKEN_SEMICOLON, "Expect ';' after value in print statement");
+  if (canFuse(currentCompiler->lastConstant, 2)) {
+    currentChunk()->code[currentChunk()->count - 2] = OP_RETURN_CONSTANT;
+    resetPeephole();
+    return;
+  }
+  if (canFuse(currentCompiler->lastCall, 2)) {
+    // `return f(...)`: the callee can take over our frame, since we
+    // would only return its result anyway. Nothing comes back to this
+    // function, so there's no OP_RETURN after it.
+    currentChunk()->code[currentChunk()->count - 2] = OP_TAIL_CALL;
+    resetPeephole();
+    return;
+  }
   emitByte(OP_RETURN);
 }
 
@@ -965,17 +1443,27 @@ static void endScope() {
 	 > outer_scope_depth)) {
     Local* local = &currentCompiler->locals[currentCompiler->localCount - 1];
     // If there's no capture, we can just let the local go out of scope.
+    // The same goes for captures that copied its value.
     //
     // Otherwise we need an opcode so the vm knows to preserve it on
     // the heap - this is how captures can hang onto locals that went
     // out of scope!
-    if (local->isCaptured) {
+    if (local->isCaptured && local->needsUpvalue) {
       emitByte(OP_CLOSE_UPVALUE);
     } else {
       emitByte(OP_POP);
     }
     currentCompiler->localCount--;
   }
+  // Forget the by-value captures of those locals, whose slots will be
+  // reused.
+  int kept = 0;
+  for (int i = 0; i < currentCompiler->valueCaptureCount; i++) {
+    if (currentCompiler->valueCaptures[i].local < currentCompiler->localCount) {
+      currentCompiler->valueCaptures[kept++] = currentCompiler->valueCaptures[i];
+    }
+  }
+  currentCompiler->valueCaptureCount = kept;
 }
 
 
@@ -999,6 +1487,7 @@ static void addLocal(Token name) {
   local->name = name;
   local->depth = -1; // we'll soon set it to `currentCompiler->scopeDepth`
   local->isCaptured = false;
+  local->needsUpvalue = false;
 }
 
 
@@ -1030,20 +1519,20 @@ void addLocalToScope() { // NOTE: the book calls this `declareVariable`
 }
 
 
-uint8_t parseVariableInDeclaration(const char* error_message) {
+int parseVariableInDeclaration(const char* error_message) {
   consume(TOKEN_IDENTIFIER, error_message);
   // For globals and locals we do different things:
   //
-  // - When we hit a global declaration, we emit code to push the name
-  //   so we can use it in OP_GLOBAL
+  // - When we hit a global declaration, we resolve the name to a global
+  //   slot so we can use it in OP_DEFINE_GLOBAL
   // - When we hit a local declaration, we don't have to emit anything
   //   but we do need to track the variable in our scope (the "resolver"
   //   logic in jlox terms)
   //
-  // We return 0 as a placeholder for the constant to push in the local
+  // We return 0 as a placeholder for the global slot in the local
   // case; the downstream code in defineVariable will ignore this.
   if (currentCompiler->scopeDepth == 0) {
-    return identifierConstant(&parser.previous);
+    return globalSlot(&parser.previous);
   } else {
     addLocalToScope();
     return 0;
@@ -1057,9 +1546,9 @@ void markLocalAsInitialized() {
 }
 
 
-void defineVariable(uint8_t global_or_local) {
+void defineVariable(int global_or_local) {
   if (currentCompiler->scopeDepth == 0) {
-    emit2Bytes(OP_DEFINE_GLOBAL, global_or_local);
+    emitIndexed(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global_or_local);
   } else {
     // For locals, we don't need to emit any opcode here. We already
     // emitted the byetocde for the RHS inside varDeclaration, and
@@ -1074,10 +1563,9 @@ void defineVariable(uint8_t global_or_local) {
   
 
 static void varDeclaration() {
-  // Push the global name onto the stack (which, in the process, adds
-  // the value to chunk.constants and the underlying ObjString* to
-  // vm.strings).
-  uint8_t global_or_local = parseVariableInDeclaration("Expect variable name.");
+  // Resolve the global slot (which, in the process, adds the underlying
+  // ObjString* to vm.strings) or declare the local.
+  int global_or_local = parseVariableInDeclaration("Expect variable name.");
   // Push the initial value on the stack - nil if no assignment
   if (match(TOKEN_EQUAL)) {
     expression();
@@ -1110,7 +1598,7 @@ static void function(FunctionType type) {
       if (compiler.function->arity > 255) {
 	errorAtPrevious("Cannot exceeed 255 parameters.");
       }
-      uint8_t param = parseVariableInDeclaration("Expect parameter name");
+      int param = parseVariableInDeclaration("Expect parameter name");
       defineVariable(param);
     } while (match(TOKEN_COMMA));
   }
@@ -1120,25 +1608,26 @@ static void function(FunctionType type) {
   // *does* consume the ending brace.
   consume(TOKEN_LEFT_BRACE, "Expect '{' to start function body.");
   block();
+  // (the local this function is being declared as, if any: see
+  // functionDeclaration)
+  int self = compiler.enclosing->scopeDepth > 0 ?
+    compiler.enclosing->localCount - 1 : -1;
   ObjFunction* function = endCompiler();
   // This opcode points at the function (which contains only constant
   // data - the bytecode + constants derived from the function *ast*)
   // and wraps it in a closure that can potentially store the runtime
   // values of captured locals.
-  emit2Bytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+  emitIndexed(OP_CLOSURE, OP_CLOSURE_LONG, makeConstant(OBJ_VAL(function)));
   // Make a record of all the StaticUpvalues, which will allow us to
   // convert them to dynamic upvalues. Note we don't need a record of
   // the count in our bytecode because that's recorded in the constant
   // ObjFunction struct itself, which the bytecode has access to.
-  for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
-  }
+  emitCaptures(&compiler, self);
 }
 
 
 static void functionDeclaration() {
-  uint8_t global_or_local = parseVariableInDeclaration("Expect function name");
+  int global_or_local = parseVariableInDeclaration("Expect function name");
   if (currentCompiler->scopeDepth != 0) {
     // Marking as initialized before we define the function will allow
     // recursion for local functions, although only after we implement
@@ -1150,13 +1639,48 @@ static void functionDeclaration() {
 }
 
 
+/* Emit the jump out of a statement-level condition (if / while / for),
+   which is OP_JUMP_IF_FALSE followed by an OP_POP of the condition when
+   it holds.
+
+   If the condition was `local < constant` we instead rewrite it into a
+   single OP_JUMP_LOCAL_NOT_LESS_CONST, which never pushes the condition;
+   in that case `*fused` is set and the caller must skip the OP_POP it
+   would otherwise emit at the jump target.
+
+   Returns the jump to patch, like emitJump. */
+static int emitConditionJump(bool* fused) {
+  Compiler* compiler = currentCompiler;
+  if (canFuse(compiler->lastGetLocal, 5) &&
+      canFuse(compiler->lastConstant, 3) &&
+      canFuse(compiler->lastLess, 1)) {
+    // OP_GET_LOCAL a; OP_CONSTANT c; OP_LESS (5 bytes) becomes the
+    // first 3 bytes of OP_JUMP_LOCAL_NOT_LESS_CONST a c <offset>.
+    Chunk* chunk = currentChunk();
+    int start = chunk->count - 5;
+    chunk->code[start] = OP_JUMP_LOCAL_NOT_LESS_CONST;
+    chunk->code[start + 2] = chunk->code[start + 3];
+    chunk->count = start + 3;
+    emit2Bytes(0xff, 0xff);
+    resetPeephole();
+    *fused = true;
+    return currentChunk()->count - 2;
+  }
+  *fused = false;
+  int jump = emitJump(OP_JUMP_IF_FALSE);
+  emitByte(OP_POP);
+  return jump;
+}
+
+
 static void ifStatement() {
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after 'if'.");
-  // create a placeholder jump with no target
-  int jump_skip_if_address = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);  // (pop the condition from jump_skip_if)
+  // create a placeholder jump with no target (this also pops the
+  // condition if we don't jump)
+  bool fused;
+  int jump_skip_if_address = emitConditionJump(&fused);
   // emit the code to run if no jump
   statement();
   // emit an unconditional jump to skip the else branch, if any
@@ -1164,7 +1688,9 @@ static void ifStatement() {
   int jump_skip_else_address = emitJump(OP_JUMP);
   // patch the jump for skipping if to point here
   patchJump(jump_skip_if_address);
-  emitByte(OP_POP);  // (pop the condition from jump_skip_if)
+  if (!fused) {
+    emitByte(OP_POP);  // (pop the condition from jump_skip_if)
+  }
   // if there is an else branch, emit the bytecode for it
   if (match(TOKEN_ELSE)) {
     statement();
@@ -1175,18 +1701,20 @@ static void ifStatement() {
 
 
 static void whileStatement() {
-  int loop_start_index = currentChunk()->count;
+  int loop_start_index = markJumpTarget();
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after 'if'.");
-  int jump_out_address = emitJump(OP_JUMP_IF_FALSE);
+  bool fused;
+  int jump_out_address = emitConditionJump(&fused);
   // while body
-  emitByte(OP_POP);
   statement();
   emitLoop(loop_start_index);
   // exit condition
   patchJump(jump_out_address);
-  emitByte(OP_POP);
+  if (!fused) {
+    emitByte(OP_POP);
+  }
 }
 
 
@@ -1203,18 +1731,18 @@ static void forStatement() {
       expressionStatement();
     }
   }
-  int loop_from_body_end_index = currentChunk()->count;
+  int loop_from_body_end_index = markJumpTarget();
   // stop condition
   int jump_out_address = -1;
+  bool fused = false;
   if (!match(TOKEN_SEMICOLON)) {
     // we can't use expressionStatement to consume the ';' here
     // because that would pop the condition! So we consume manually.
     expression();
-    jump_out_address = emitJump(OP_JUMP_IF_FALSE);
     consume(TOKEN_SEMICOLON, "Expect ';'.");
     // at this point we've either jumped or we're going to start
-    // the loop cycle; in the latter case, we must pop condition.
-    emitByte(OP_POP);
+    // the loop cycle; in the latter case, the condition is popped.
+    jump_out_address = emitConditionJump(&fused);
   }
   // incrementer
   //
@@ -1232,10 +1760,10 @@ static void forStatement() {
     // hot patch so that end of body will loop here, whereas we'll
     // loop from here back to the start.
     int loop_to_start = loop_from_body_end_index;
-    loop_from_body_end_index = currentChunk()->count;
+    loop_from_body_end_index = markJumpTarget();
     // this is like expressionStatement, but it doesn't conume a `;`.
     expression();
-    emitByte(OP_POP);
+    emitStatementPop();
     // okay we are almost... check syntax and loop back to condition
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after 'if'.");
     emitLoop(loop_to_start);
@@ -1250,7 +1778,9 @@ static void forStatement() {
   // exit condition (if there's an exit clause)
   if (jump_out_address != -1) {
     patchJump(jump_out_address);
-    emitByte(OP_POP);
+    if (!fused) {
+      emitByte(OP_POP);
+    }
   }
   endScope();
 }
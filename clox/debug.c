@@ -5,6 +5,71 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
+
+
+bool debugTraceExecution = false;
+bool debugPrintCode = false;
+bool debugPrintStats = false;
+
+
+static const char* opcodeNames[] = {
+  [OP_ADD] = "OP_ADD",
+  [OP_ADD_LOCALS] = "OP_ADD_LOCALS",
+  [OP_ADD_NUM] = "OP_ADD_NUM",
+  [OP_ADD_STR] = "OP_ADD_STR",
+  [OP_CALL] = "OP_CALL",
+  [OP_CONSTANT] = "OP_CONSTANT",
+  [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+  [OP_CLOSURE] = "OP_CLOSURE",
+  [OP_CLOSURE_LONG] = "OP_CLOSURE_LONG",
+  [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+  [OP_DIVIDE] = "OP_DIVIDE",
+  [OP_DIVIDE_NUM] = "OP_DIVIDE_NUM",
+  [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+  [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+  [OP_EQUAL] = "OP_EQUAL",
+  [OP_FALSE] = "OP_FALSE",
+  [OP_JUMP] = "OP_JUMP",
+  [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+  [OP_JUMP_LOCAL_NOT_LESS_CONST] = "OP_JUMP_LOCAL_NOT_LESS_CONST",
+  [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+  [OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+  [OP_GET_LOCAL] = "OP_GET_LOCAL",
+  [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+  [OP_GREATER] = "OP_GREATER",
+  [OP_GREATER_NUM] = "OP_GREATER_NUM",
+  [OP_LESS] = "OP_LESS",
+  [OP_LESS_NUM] = "OP_LESS_NUM",
+  [OP_LOOP] = "OP_LOOP",
+  [OP_MULTIPLY] = "OP_MULTIPLY",
+  [OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+  [OP_NEGATE] = "OP_NEGATE",
+  [OP_NIL] = "OP_NIL",
+  [OP_NOT] = "OP_NOT",
+  [OP_POP] = "OP_POP",
+  [OP_PRINT] = "OP_PRINT",
+  [OP_RETURN] = "OP_RETURN",
+  [OP_RETURN_CONSTANT] = "OP_RETURN_CONSTANT",
+  [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+  [OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+  [OP_SET_LOCAL] = "OP_SET_LOCAL",
+  [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+  [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+  [OP_SUBTRACT] = "OP_SUBTRACT",
+  [OP_SUBTRACT_NUM] = "OP_SUBTRACT_NUM",
+  [OP_TAIL_CALL] = "OP_TAIL_CALL",
+  [OP_TRUE] = "OP_TRUE",
+};
+
+
+const char* opcodeName(uint8_t opcode) {
+  if (opcode < sizeof(opcodeNames) / sizeof(opcodeNames[0]) &&
+      opcodeNames[opcode] != NULL) {
+    return opcodeNames[opcode];
+  }
+  return "<unknown>";
+}
 
 
 void disassembleChunk(Chunk* chunk, const char* name) {
@@ -24,14 +89,43 @@ int simpleInstruction(const char* name, int offset) {
   return offset + 1;
 }
 
+// Read the constant / global slot operand of the instruction at
+// `offset`, which is 3 bytes for the _LONG opcodes and 1 otherwise.
+static int indexOperand(Chunk* chunk, int offset, int* width) {
+  uint8_t* operand = &chunk->code[offset + 1];
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT_LONG:
+  case OP_CLOSURE_LONG:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_GET_GLOBAL_LONG:
+  case OP_SET_GLOBAL_LONG:
+    *width = 3;
+    return (operand[0] << 16) | (operand[1] << 8) | operand[2];
+  default:
+    *width = 1;
+    return operand[0];
+  }
+}
+
+
 int constantInstruction(const char* name, Chunk* chunk, int offset) {
   // opcode should be left-justified with 16 columns of space
   // the constant prints as it's index plus (in single quotes) the value.
-  uint8_t constant_index = chunk->code[offset + 1];
+  int width;
+  int constant_index = indexOperand(chunk, offset, &width);
   printf("%-16s %4d '", name, constant_index);
   printValue(chunk->constants.values[constant_index]);
   printf("'\n");
-  return offset + 2;
+  return offset + 1 + width;
+}
+
+
+int globalInstruction(const char* name, Chunk* chunk, int offset) {
+  // Globals are slots rather than constants; print the slot's name.
+  int width;
+  int slot = indexOperand(chunk, offset, &width);
+  printf("%-16s %4d '%s'\n", name, slot, vmGlobalName(slot)->chars);
+  return offset + 1 + width;
 }
 
 
@@ -52,24 +146,44 @@ int jumpInstruction(const char* name, Chunk* chunk, int offset) {
 }
 
 
-int closureInstruction(Chunk* chunk, int offset) {
-  // TODO: at the moment this is basically the same as
-  // constantInstruction, but it will ge more elaborate by the time we
-  // finish with closure.
-  uint8_t constant_index = chunk->code[offset + 1];
-  printf("%-16s %4d '", "OP_CLOSURE", constant_index);
+int twoByteInstruction(const char* name, Chunk* chunk, int offset) {
+  printf("%-16s %4d %4d\n", name, chunk->code[offset + 1], chunk->code[offset + 2]);
+  return offset + 3;
+}
+
+
+int localLessConstJumpInstruction(const char* name, Chunk* chunk, int offset) {
+  // local slot, then constant, then a jump address like jumpInstruction
+  uint8_t stack_index = chunk->code[offset + 1];
+  uint8_t constant_index = chunk->code[offset + 2];
+  uint16_t address = (uint16_t)(chunk->code[offset + 3] << 8);
+  address |= chunk->code[offset + 4];
+  printf("%-16s %4d < '", name, stack_index);
+  printValue(chunk->constants.values[constant_index]);
+  printf("' else %d\n", address);
+  return offset + 5;
+}
+
+
+int closureInstruction(const char* name, Chunk* chunk, int offset) {
+  // Like constantInstruction, followed by the upvalue (kind, index)
+  // pairs.
+  int width;
+  int constant_index = indexOperand(chunk, offset, &width);
+  printf("%-16s %4d '", name, constant_index);
   Value value = chunk->constants.values[constant_index];
   ObjFunction* function = AS_FUNCTION(value);
   printValue(value);
   printf("'\n");
-  int i = 0;
-  for (; i < function->upvalueCount; i++) {
-    int isLocal = chunk->code[offset + 2 * i + 2];
-    int index = chunk->code[offset + 2 * i + 3];
+  int next = offset + 1 + width;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    int kind = chunk->code[next++];
+    int index = chunk->code[next++];
     printf("%04d      |                     %s %d\n",
-	   offset - 2, isLocal ? "local" : "not-local", index);
+	   offset - 2, kind == CAPTURE_UPVALUE ? "not-local" :
+	   kind == CAPTURE_LOCAL ? "local" : "local value", index);
   }
-  return offset + 2 * (i + 1);
+  return next;
 }
 
 
@@ -88,16 +202,26 @@ int disassembleInstruction(const char* tag, Chunk* chunk, int offset) {
   switch (instruction) {
   case OP_CONSTANT:
     return constantInstruction("OP_CONSTANT", chunk, offset);
+  case OP_CONSTANT_LONG:
+    return constantInstruction("OP_CONSTANT_LONG", chunk, offset);
   case OP_DEFINE_GLOBAL:
-    return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+  case OP_DEFINE_GLOBAL_LONG:
+    return globalInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
   case OP_GET_GLOBAL:
-    return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_GET_GLOBAL", chunk, offset);
+  case OP_GET_GLOBAL_LONG:
+    return globalInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
   case OP_SET_GLOBAL:
-    return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_SET_GLOBAL", chunk, offset);
+  case OP_SET_GLOBAL_LONG:
+    return globalInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
   case OP_GET_LOCAL:
     return byteInstruction("OP_GET_LOCAL", chunk, offset);
   case OP_SET_LOCAL:
     return byteInstruction("OP_SET_LOCAL", chunk, offset);
+  case OP_SET_LOCAL_POP:
+    return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
   case OP_GET_UPVALUE:
     return byteInstruction("OP_GET_UPVALUE", chunk, offset);
   case OP_SET_UPVALUE:
@@ -112,20 +236,38 @@ int disassembleInstruction(const char* tag, Chunk* chunk, int offset) {
     return simpleInstruction("OP_TRUE", offset);
   case OP_RETURN:
     return simpleInstruction("OP_RETURN", offset);
+  case OP_RETURN_CONSTANT:
+    return constantInstruction("OP_RETURN_CONSTANT", chunk, offset);
   case OP_ADD:
     return simpleInstruction("OP_ADD", offset);
+  case OP_ADD_LOCALS:
+    return twoByteInstruction("OP_ADD_LOCALS", chunk, offset);
+  case OP_ADD_NUM:
+    return simpleInstruction("OP_ADD_NUM", offset);
+  case OP_ADD_STR:
+    return simpleInstruction("OP_ADD_STR", offset);
   case OP_SUBTRACT:
     return simpleInstruction("OP_SUBTRACT", offset);
+  case OP_SUBTRACT_NUM:
+    return simpleInstruction("OP_SUBTRACT_NUM", offset);
   case OP_MULTIPLY:
     return simpleInstruction("OP_MULTIPLY", offset);
+  case OP_MULTIPLY_NUM:
+    return simpleInstruction("OP_MULTIPLY_NUM", offset);
   case OP_DIVIDE:
     return simpleInstruction("OP_DIVIDE", offset);
+  case OP_DIVIDE_NUM:
+    return simpleInstruction("OP_DIVIDE_NUM", offset);
   case OP_EQUAL:
     return simpleInstruction("OP_EQUAL", offset);
   case OP_LESS:
     return simpleInstruction("OP_LESS", offset);
+  case OP_LESS_NUM:
+    return simpleInstruction("OP_LESS_NUM", offset);
   case OP_GREATER:
     return simpleInstruction("OP_GREATER", offset);
+  case OP_GREATER_NUM:
+    return simpleInstruction("OP_GREATER_NUM", offset);
   case OP_NEGATE:
     return simpleInstruction("OP_NEGATE", offset);
   case OP_NOT:
@@ -140,10 +282,16 @@ int disassembleInstruction(const char* tag, Chunk* chunk, int offset) {
     return jumpInstruction("OP_JUMP", chunk, offset);
   case OP_JUMP_IF_FALSE:
     return jumpInstruction("OP_JUMP_IF_FALSE", chunk, offset);
+  case OP_JUMP_LOCAL_NOT_LESS_CONST:
+    return localLessConstJumpInstruction("OP_JUMP_LOCAL_NOT_LESS_CONST", chunk, offset);
   case OP_CALL:
     return byteInstruction("OP_CALL", chunk, offset);
+  case OP_TAIL_CALL:
+    return byteInstruction("OP_TAIL_CALL", chunk, offset);
   case OP_CLOSURE:
-    return closureInstruction(chunk, offset);
+    return closureInstruction("OP_CLOSURE", chunk, offset);
+  case OP_CLOSURE_LONG:
+    return closureInstruction("OP_CLOSURE_LONG", chunk, offset);
   default:
     printf("Unknown opcode %d\n", instruction);
     return offset + 1;
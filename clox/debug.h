@@ -4,8 +4,20 @@
 #include "value.h"
 #include "chunk.h"
 
+// Runtime debugging switches, set from command-line flags in main.c:
+// - debugTraceExecution (--trace) prints the stack and each instruction
+//   as the vm runs it.
+// - debugPrintCode (--dump-bytecode) disassembles each function once
+//   the compiler finishes it.
+// - debugPrintStats (--stats) prints vm counters (e.g. quickening) to
+//   stderr when a script finishes.
+extern bool debugTraceExecution;
+extern bool debugPrintCode;
+extern bool debugPrintStats;
+
 void disassembleChunk(Chunk* chunk, const char* name);
 void printValue(Value value);
 int disassembleInstruction(const char* tag, Chunk* chunk, int offset);
+const char* opcodeName(uint8_t opcode);
 
 #endif
@@ -0,0 +1,718 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+
+#include "heap.h"
+
+
+/* A size-class slab allocator for objects.
+
+   Objects up to SLAB_MAX_SLOT bytes are rounded up to a multiple of
+   SLOT_ALIGN, and each such size class carves its objects out of
+   SLAB_SIZE-byte slabs. A slab is aligned to its size, so we can get
+   from an object to its slab by masking the address.
+
+   Each slab has two bitmaps, one bit per slot: which slots hold an
+   object, and which of those are marked. So marking doesn't write to
+   the objects at all, and for the sweep, the dead objects in a slab are
+   `allocated & ~marked`, a word at a time. The only objects the sweep
+   looks at are the dead ones, to free whatever they own (say, a
+   function's chunk). There are no free lists: each class allocates from
+   one slab at a time, taking the first clear bit in `allocated`.
+
+   Sweeping is lazy. When marking is done, heapStartSweep just starts a
+   new sweep epoch, and then each size class sweeps a slab when its
+   allocation cursor gets there, right before allocating from it. So the
+   cost of the sweep is spread over the allocations that use the space it
+   frees, and a slab always gets swept before anything new goes in it.
+   Whatever no allocation has reached by the next collection gets swept
+   then (or a slice at a time in the meantime, in incremental mode).
+   Slabs that go a whole GC cycle without being used are given back.
+   (Freeing them as soon as they are empty is a bad idea: most objects
+   die young, so the next cycle would just allocate them all over again.)
+
+   Bigger objects (long strings, closures with lots of upvalues) each get
+   their own block, kept on a separate list, with the mark bit in the
+   block's header. A sweep covers the large objects that existed when it
+   started; allocating a large object sweeps some of those first.
+
+   Like the markstack, slabs come from plain malloc rather than
+   reallocate(); the GC accounting is per object, in heapAllocate and
+   the sweep.
+
+   With --gc-sweep-thread, a background thread sweeps too, as soon as a
+   collection has finished marking, so that the program rarely has to
+   sweep a slab itself. Only one thread may sweep a slab, and a slab
+   can't be allocated from while it's being swept, so a thread claims a
+   slab first by swapping its sweptEpoch for SLAB_SWEEPING; whoever loses
+   moves on to the next slab. Everything else stays with the main thread:
+   - Objects that own memory (functions) have to be freed through
+     reallocate(), which isn't thread-safe and may even collect, so the
+     sweeper leaves them allocated and hands them over.
+   - The GC accounting: the sweeper keeps its own counts, and the main
+     thread adds them up when the sweep is over.
+   - Unlinking slabs: while the sweeper walks the slab lists, the only
+     change to them is the allocator appending a new slab (with a release
+     store, so the sweeper sees it initialized). Slabs that stayed empty
+     are given back at the end of the sweep instead.
+   - Large objects, which are rare enough to keep sweeping lazily.
+   The end of the sweep is the start of the next collection: the main
+   thread sweeps whatever slabs are left, waits for the sweeper to finish
+   its current one, and then does all of the above.
+
+   In generational mode (see memory.c) we also keep a list of the objects
+   allocated since the last collection, i.e. the young ones, so that a
+   young collection can sweep just those. Full collections sweep right
+   away in that mode, because a young object in a slab that hasn't been
+   swept yet would look just like a dead one.
+*/
+
+
+#define SIZE_CLASS_COUNT (SLAB_MAX_SLOT / SLOT_ALIGN)
+
+
+typedef struct {
+  Slab* slabs;
+  // The slab we're allocating from, and the first word of its bitmap
+  // that may have a free slot. The slabs before it in the list were full
+  // when we went past them.
+  Slab* current;
+  int currentWord;
+} SizeClass;
+
+
+static SizeClass sizeClasses[SIZE_CLASS_COUNT];
+static LargeObject* largeObjects = NULL;
+
+size_t heapMarkedBytes = 0;
+size_t heapObjectBytes = 0;
+size_t heapUnsweptGarbage = 0;
+double heapLazySweepSeconds = 0;
+
+// The young objects, oldest first (only in generational mode).
+static Obj** nursery = NULL;
+static int nurseryCount = 0;
+static int nurseryCapacity = 0;
+
+// The sweep. A slab needs sweeping if its sweptEpoch isn't sweepEpoch.
+// sweepClass, sweepLink and sweepLarge are how far heapSweepSlice has
+// got; sweepClass is SIZE_CLASS_COUNT and sweepLarge NULL when there's
+// nothing left to sweep.
+static unsigned sweepEpoch = 0;
+static int sweepClass = SIZE_CLASS_COUNT;
+static Slab** sweepLink;
+static LargeObject* sweepLarge = NULL;
+
+// What a slab's sweptEpoch is while a thread sweeps it.
+#define SLAB_SWEEPING ((unsigned)-1)
+
+// What a sweep found, to add to the GC accounting afterwards.
+typedef struct {
+  size_t swept;
+  size_t freed;
+  size_t freedBytes;
+  size_t unmarkedBytes;  // the size of the marked objects it unmarked
+} SweepCounts;
+
+// The background sweeper (only with --gc-sweep-thread). The main thread
+// sets sweeperBusy and sweeperEpoch to start it on a sweep, and the
+// sweeper clears sweeperBusy when it's done; the rest belongs to the
+// sweeper while it's busy, and to the main thread otherwise.
+static bool backgroundSweep = false;
+static pthread_mutex_t sweeperLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sweeperStart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sweeperDone = PTHREAD_COND_INITIALIZER;
+static bool sweeperBusy = false;
+static unsigned sweeperEpoch = 0;
+static SweepCounts sweeperCounts;
+static double sweeperSeconds = 0;
+// Dead objects that own memory, for the main thread to free.
+static Obj** sweeperHandedOver = NULL;
+static int sweeperHandedOverCount = 0;
+static int sweeperHandedOverCapacity = 0;
+
+double heapBackgroundSweepSeconds = 0;
+
+
+static void outOfMemory() {
+  fprintf(stderr, "clox: out of memory, exiting now %s:%d", __FILE__, __LINE__);
+  exit(1);
+}
+
+
+static inline int bitmapWords(Slab* slab) {
+  return (slab->slotCount + 63) / 64;
+}
+
+
+static Slab* newSlab(size_t slot_size) {
+  Slab* slab = (Slab*)aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+  if (slab == NULL) {
+    outOfMemory();
+  }
+  slab->next = NULL;
+  slab->slotSize = slot_size;
+  slab->slotCount = (SLAB_SIZE - SLAB_HEADER_SIZE) / slot_size;
+  slab->slotReciprocal =
+    (uint32_t)((((uint64_t)1 << 32) + slot_size - 1) / slot_size);
+  slab->sweptEpoch = sweepEpoch;
+  memset(slab->allocated, 0, sizeof(slab->allocated));
+  memset(slab->marked, 0, sizeof(slab->marked));
+  return slab;
+}
+
+
+static void countFreed(size_t bytes) {
+  heapObjectBytes -= bytes;
+  heapUnsweptGarbage -= bytes < heapUnsweptGarbage ? bytes : heapUnsweptGarbage;
+  trackAllocation(bytes, 0);
+}
+
+
+static void applyCounts(SweepCounts* counts) {
+  gcObjectsSwept += counts->swept;
+  gcObjectsFreed += counts->freed;
+  heapMarkedBytes -= counts->unmarkedBytes;
+  countFreed(counts->freedBytes);
+}
+
+
+// Claim a slab that still needs sweeping in `epoch`, so that nothing
+// else sweeps it or allocates from it until we're done.
+static bool claimSlab(Slab* slab, unsigned epoch) {
+  unsigned swept = __atomic_load_n(&slab->sweptEpoch, __ATOMIC_ACQUIRE);
+  return swept != epoch && swept != SLAB_SWEEPING &&
+    __atomic_compare_exchange_n(&slab->sweptEpoch, &swept, SLAB_SWEEPING,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+
+static bool isSwept(Slab* slab, unsigned epoch) {
+  return __atomic_load_n(&slab->sweptEpoch, __ATOMIC_ACQUIRE) == epoch;
+}
+
+
+static void handOver(Obj* object) {
+  if (sweeperHandedOverCapacity < sweeperHandedOverCount + 1) {
+    sweeperHandedOverCapacity = GROW_CAPACITY(sweeperHandedOverCapacity);
+    sweeperHandedOver = (Obj**)realloc(sweeperHandedOver,
+				       sizeof(Obj*) * sweeperHandedOverCapacity);
+    if (sweeperHandedOver == NULL) {
+      outOfMemory();
+    }
+  }
+  sweeperHandedOver[sweeperHandedOverCount++] = object;
+}
+
+
+// Sweep a slab we've claimed, and release it. On the sweeper thread
+// (`on_sweeper`), the dead objects that own memory stay allocated, to
+// be handed over. Returns whether anything was allocated in the slab.
+static bool sweepSlabObjects(Slab* slab, unsigned epoch, SweepCounts* counts,
+			     bool on_sweeper) {
+  bool keep_marks = gcNurserySize > 0;
+  bool used = false;
+  for (int w = 0; w < bitmapWords(slab); w++) {
+    uint64_t allocated = slab->allocated[w];
+    if (allocated == 0) {
+      continue;
+    }
+    used = true;
+    uint64_t marked = slab->marked[w];
+    uint64_t kept = marked;
+    counts->swept += __builtin_popcountll(allocated);
+    for (uint64_t dead = allocated & ~marked; dead != 0; dead &= dead - 1) {
+      int bit = __builtin_ctzll(dead);
+      Obj* object = SLAB_SLOT(slab, w * 64 + bit);
+      if (!on_sweeper) {
+	freeObject(object);
+      } else if (objectOwnsMemory(object)) {
+	handOver(object);
+	kept |= (uint64_t)1 << bit;
+	continue;
+      }
+      counts->freed++;
+      counts->freedBytes += slab->slotSize;
+    }
+    slab->allocated[w] = kept;
+    if (!keep_marks) {
+      counts->unmarkedBytes += __builtin_popcountll(marked) * slab->slotSize;
+      slab->marked[w] = 0;
+    }
+  }
+  __atomic_store_n(&slab->sweptEpoch, epoch, __ATOMIC_RELEASE);
+  return used;
+}
+
+
+// Sweep the slab at *link, which the main thread has claimed (or free
+// it, if nothing was allocated in it all cycle and there's no sweeper
+// walking the lists). Returns the link to the next slab.
+static Slab** sweepSlab(Slab** link) {
+  Slab* slab = *link;
+  SweepCounts counts = {0, 0, 0, 0};
+  bool used = sweepSlabObjects(slab, sweepEpoch, &counts, false);
+  applyCounts(&counts);
+  if (!used && !backgroundSweep) {
+    // This is never a size class's current slab: that one has been
+    // swept already.
+    *link = slab->next;
+    free(slab);
+    return link;
+  }
+  return &slab->next;
+}
+
+
+// Move a size class on to the next slab it can allocate from, sweeping
+// slabs on the way; if there isn't one, add a new slab at the end.
+static Slab* nextSlab(SizeClass* size_class, size_t slot_size) {
+  Slab** link = size_class->current != NULL
+    ? &size_class->current->next : &size_class->slabs;
+  while (*link != NULL) {
+    Slab* slab = *link;
+    if (claimSlab(slab, sweepEpoch)) {
+      double start = gcSecondsNow();
+      Slab** next = sweepSlab(link);
+      heapLazySweepSeconds += gcSecondsNow() - start;
+      if (next == link) {
+	continue;  // we freed it
+      }
+    }
+    if (isSwept(slab, sweepEpoch)) {
+      break;
+    }
+    // The sweeper has it. Whatever it frees there will have to wait for
+    // the next cycle.
+    link = &slab->next;
+  }
+  if (*link == NULL) {
+    __atomic_store_n(link, newSlab(slot_size), __ATOMIC_RELEASE);
+  }
+  size_class->current = *link;
+  size_class->currentWord = 0;
+  return *link;
+}
+
+
+// Take the first free slot at or after word `*word` of the slab's
+// bitmap, or return -1 if there isn't one.
+static int takeSlot(Slab* slab, int* word) {
+  int words = bitmapWords(slab);
+  for (int w = *word; w < words; w++) {
+    uint64_t free_slots = ~slab->allocated[w];
+    if (free_slots != 0) {
+      int index = w * 64 + __builtin_ctzll(free_slots);
+      if (index >= slab->slotCount) {
+	break;
+      }
+      slab->allocated[w] |= (uint64_t)1 << (index % 64);
+      *word = w;
+      return index;
+    }
+  }
+  *word = words;
+  return -1;
+}
+
+
+static Obj* allocateSlot(size_t size) {
+  size_t slot_size = ALIGN_SLOT(size);
+  SizeClass* size_class = &sizeClasses[slot_size / SLOT_ALIGN - 1];
+  // This has to come before we look at the current slab: it may collect,
+  // which starts the class over from its first slab.
+  trackAllocation(0, slot_size);
+
+  Slab* slab = size_class->current;
+  int index = slab != NULL ? takeSlot(slab, &size_class->currentWord) : -1;
+  while (index < 0) {
+    slab = nextSlab(size_class, slot_size);
+    index = takeSlot(slab, &size_class->currentWord);
+  }
+  heapObjectBytes += slot_size;
+  Obj* object = SLAB_SLOT(slab, index);
+  object->isLarge = false;
+  return object;
+}
+
+
+static void unlinkLarge(LargeObject* large) {
+  if (large == sweepLarge) {
+    sweepLarge = large->next;
+  }
+  if (large->previous != NULL) {
+    large->previous->next = large->next;
+  } else {
+    largeObjects = large->next;
+  }
+  if (large->next != NULL) {
+    large->next->previous = large->previous;
+  }
+}
+
+
+// Sweep one large object, returning the next one.
+static LargeObject* sweepLargeObject(LargeObject* large) {
+  LargeObject* next = large->next;
+  gcObjectsSwept++;
+  if (large->isMarked) {
+    if (gcNurserySize == 0) {
+      large->isMarked = false;
+      heapMarkedBytes -= large->size;
+    }
+    return next;
+  }
+  unlinkLarge(large);
+  freeObject(LARGE_OBJECT(large));
+  gcObjectsFreed++;
+  countFreed(large->size);
+  free(large);
+  return next;
+}
+
+
+static Obj* allocateLarge(size_t size) {
+  trackAllocation(0, size);
+  // Before taking more memory, sweep until we've freed as much (or run
+  // out of large objects to sweep).
+  if (sweepLarge != NULL) {
+    double start = gcSecondsNow();
+    size_t before = heapObjectBytes;
+    while (sweepLarge != NULL && before - heapObjectBytes < size) {
+      sweepLarge = sweepLargeObject(sweepLarge);
+    }
+    heapLazySweepSeconds += gcSecondsNow() - start;
+  }
+  LargeObject* large = (LargeObject*)malloc(LARGE_HEADER_SIZE + size);
+  if (large == NULL) {
+    outOfMemory();
+  }
+  large->size = size;
+  large->isMarked = false;
+  large->next = largeObjects;
+  large->previous = NULL;
+  if (largeObjects != NULL) {
+    largeObjects->previous = large;
+  }
+  largeObjects = large;
+  heapObjectBytes += size;
+  Obj* object = LARGE_OBJECT(large);
+  object->isLarge = true;
+  return object;
+}
+
+
+static void addToNursery(Obj* object) {
+  if (nurseryCapacity < nurseryCount + 1) {
+    nurseryCapacity = nurseryCapacity < 256 ? 256 : nurseryCapacity * 2;
+    nursery = (Obj**)realloc(nursery, sizeof(Obj*) * nurseryCapacity);
+    if (nursery == NULL) {
+      outOfMemory();
+    }
+  }
+  nursery[nurseryCount++] = object;
+}
+
+
+Obj* heapAllocate(size_t size) {
+  // Any collection happens inside the allocation, so this object is
+  // young whatever happens.
+  Obj* object = size > SLAB_MAX_SLOT ? allocateLarge(size) : allocateSlot(size);
+  if (gcNurserySize > 0) {
+    addToNursery(object);
+  }
+  return object;
+}
+
+
+// Give an unmarked object's memory back, without calling freeObject.
+static void releaseObject(Obj* object) {
+  if (object->isLarge) {
+    LargeObject* large = LARGE_HEADER(object);
+    unlinkLarge(large);
+    heapObjectBytes -= large->size;
+    trackAllocation(large->size, 0);
+    free(large);
+    return;
+  }
+  Slab* slab = SLAB_OF(object);
+  int index = SLOT_INDEX(slab, object);
+  slab->allocated[index / 64] &= ~((uint64_t)1 << (index % 64));
+  heapObjectBytes -= slab->slotSize;
+  trackAllocation(slab->slotSize, 0);
+  // Let the allocation cursor find the slot again, if it has gone past.
+  SizeClass* size_class = &sizeClasses[slab->slotSize / SLOT_ALIGN - 1];
+  if (size_class->current == slab && size_class->currentWord > index / 64) {
+    size_class->currentWord = index / 64;
+  }
+}
+
+
+void heapFree(Obj* object) {
+  // This is always the most recently allocated object.
+  if (nurseryCount > 0 && nursery[nurseryCount - 1] == object) {
+    nurseryCount--;
+  }
+  releaseObject(object);
+}
+
+
+Obj** heapYoungObjects(int* count) {
+  *count = nurseryCount;
+  return nursery;
+}
+
+
+// Start every size class over from its first slab.
+static void resetCursors() {
+  for (int c = 0; c < SIZE_CLASS_COUNT; c++) {
+    sizeClasses[c].current = NULL;
+    sizeClasses[c].currentWord = 0;
+  }
+}
+
+
+void heapSweepNursery() {
+  for (int i = 0; i < nurseryCount; i++) {
+    Obj* object = nursery[i];
+    gcObjectsSwept++;
+    if (heapIsMarked(object)) {
+      // It survived, so it's old now; the mark stays.
+      continue;
+    }
+    freeObject(object);
+    releaseObject(object);
+    gcObjectsFreed++;
+  }
+  nurseryCount = 0;
+  // Most of the slots we just freed are behind the cursors.
+  resetCursors();
+}
+
+
+void heapClearMarks() {
+  for (int c = 0; c < SIZE_CLASS_COUNT; c++) {
+    for (Slab* slab = sizeClasses[c].slabs; slab != NULL; slab = slab->next) {
+      memset(slab->marked, 0, sizeof(slab->marked));
+    }
+  }
+  for (LargeObject* large = largeObjects; large != NULL; large = large->next) {
+    large->isMarked = false;
+  }
+  heapMarkedBytes = 0;
+}
+
+
+void heapStartSweep() {
+  sweepEpoch++;
+  if (sweepEpoch == SLAB_SWEEPING) {
+    sweepEpoch = 0;
+  }
+  sweepClass = 0;
+  sweepLink = &sizeClasses[0].slabs;
+  sweepLarge = largeObjects;
+  resetCursors();
+  heapUnsweptGarbage = heapObjectBytes - heapMarkedBytes;
+  if (backgroundSweep) {
+    pthread_mutex_lock(&sweeperLock);
+    sweeperEpoch = sweepEpoch;
+    sweeperBusy = true;
+    pthread_cond_signal(&sweeperStart);
+    pthread_mutex_unlock(&sweeperLock);
+  }
+}
+
+
+bool heapSweepSlice(size_t budget) {
+  size_t work = 0;
+  while (sweepClass < SIZE_CLASS_COUNT) {
+    while (*sweepLink != NULL) {
+      if (work >= budget) {
+	return false;
+      }
+      Slab* slab = *sweepLink;
+      if (!claimSlab(slab, sweepEpoch)) {
+	// Allocation (or the sweeper) got here first.
+	sweepLink = &slab->next;
+	continue;
+      }
+      sweepLink = sweepSlab(sweepLink);
+      work += SLAB_SIZE;
+    }
+    sweepClass++;
+    if (sweepClass < SIZE_CLASS_COUNT) {
+      sweepLink = &sizeClasses[sweepClass].slabs;
+    }
+  }
+  while (sweepLarge != NULL) {
+    if (work >= budget) {
+      return false;
+    }
+    work += sweepLarge->size;
+    sweepLarge = sweepLargeObject(sweepLarge);
+  }
+  heapUnsweptGarbage = 0;
+  return true;
+}
+
+
+static void* sweeperMain(void* argument) {
+  (void)argument;
+  for (;;) {
+    pthread_mutex_lock(&sweeperLock);
+    while (!sweeperBusy) {
+      pthread_cond_wait(&sweeperStart, &sweeperLock);
+    }
+    unsigned epoch = sweeperEpoch;
+    pthread_mutex_unlock(&sweeperLock);
+
+    double start = gcSecondsNow();
+    for (int c = 0; c < SIZE_CLASS_COUNT; c++) {
+      Slab* slab = __atomic_load_n(&sizeClasses[c].slabs, __ATOMIC_ACQUIRE);
+      for (; slab != NULL; slab = __atomic_load_n(&slab->next, __ATOMIC_ACQUIRE)) {
+	if (claimSlab(slab, epoch)) {
+	  sweepSlabObjects(slab, epoch, &sweeperCounts, true);
+	}
+      }
+    }
+    sweeperSeconds += gcSecondsNow() - start;
+
+    pthread_mutex_lock(&sweeperLock);
+    sweeperBusy = false;
+    pthread_cond_signal(&sweeperDone);
+    pthread_mutex_unlock(&sweeperLock);
+  }
+  return NULL;
+}
+
+
+void heapStartSweepThread() {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, sweeperMain, NULL) != 0) {
+    fprintf(stderr, "clox: couldn't start the sweeper thread, exiting now %s:%d", __FILE__, __LINE__);
+    exit(1);
+  }
+  pthread_detach(thread);
+  backgroundSweep = true;
+}
+
+
+// heapFinishSweep with the sweeper: see the comment at the top.
+static void finishBackgroundSweep() {
+  for (int c = 0; c < SIZE_CLASS_COUNT; c++) {
+    for (Slab** link = &sizeClasses[c].slabs; *link != NULL;
+	 link = &(*link)->next) {
+      if (claimSlab(*link, sweepEpoch)) {
+	sweepSlab(link);
+      }
+    }
+  }
+  pthread_mutex_lock(&sweeperLock);
+  while (sweeperBusy) {
+    pthread_cond_wait(&sweeperDone, &sweeperLock);
+  }
+  pthread_mutex_unlock(&sweeperLock);
+
+  applyCounts(&sweeperCounts);
+  sweeperCounts = (SweepCounts){0, 0, 0, 0};
+  heapBackgroundSweepSeconds += sweeperSeconds;
+  sweeperSeconds = 0;
+  for (int i = 0; i < sweeperHandedOverCount; i++) {
+    freeObject(sweeperHandedOver[i]);
+    releaseObject(sweeperHandedOver[i]);
+    gcObjectsFreed++;
+  }
+  sweeperHandedOverCount = 0;
+
+  for (int c = 0; c < SIZE_CLASS_COUNT; c++) {
+    SizeClass* size_class = &sizeClasses[c];
+    Slab** link = &size_class->slabs;
+    while (*link != NULL) {
+      Slab* slab = *link;
+      bool empty = true;
+      for (int w = 0; w < bitmapWords(slab) && empty; w++) {
+	empty = slab->allocated[w] == 0;
+      }
+      if (!empty) {
+	link = &slab->next;
+	continue;
+      }
+      if (size_class->current == slab) {
+	size_class->current = NULL;
+	size_class->currentWord = 0;
+      }
+      *link = slab->next;
+      free(slab);
+    }
+  }
+  sweepClass = SIZE_CLASS_COUNT;
+
+  while (sweepLarge != NULL) {
+    sweepLarge = sweepLargeObject(sweepLarge);
+  }
+  heapUnsweptGarbage = 0;
+}
+
+
+void heapFinishSweep() {
+  if (backgroundSweep) {
+    finishBackgroundSweep();
+  } else {
+    heapSweepSlice((size_t)-1);
+  }
+}
+
+
+void heapSweep() {
+  heapStartSweep();
+  heapFinishSweep();
+  // Everything that's left has survived a collection.
+  nurseryCount = 0;
+}
+
+
+void heapFreeAll() {
+  if (backgroundSweep) {
+    // The sweeper mustn't be in the middle of anything.
+    finishBackgroundSweep();
+  }
+  for (int c = 0; c < SIZE_CLASS_COUNT; c++) {
+    Slab* slab = sizeClasses[c].slabs;
+    while (slab != NULL) {
+      Slab* next = slab->next;
+      for (int w = 0; w < bitmapWords(slab); w++) {
+	for (uint64_t allocated = slab->allocated[w]; allocated != 0;
+	     allocated &= allocated - 1) {
+	  freeObject(SLAB_SLOT(slab, w * 64 + __builtin_ctzll(allocated)));
+	}
+      }
+      free(slab);
+      slab = next;
+    }
+    sizeClasses[c].slabs = NULL;
+  }
+  resetCursors();
+  LargeObject* large = largeObjects;
+  while (large != NULL) {
+    LargeObject* next = large->next;
+    freeObject(LARGE_OBJECT(large));
+    free(large);
+    large = next;
+  }
+  largeObjects = NULL;
+  sweepClass = SIZE_CLASS_COUNT;
+  sweepLarge = NULL;
+  heapMarkedBytes = 0;
+  heapObjectBytes = 0;
+  heapUnsweptGarbage = 0;
+  free(nursery);
+  nursery = NULL;
+  nurseryCount = 0;
+  nurseryCapacity = 0;
+}
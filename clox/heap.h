@@ -0,0 +1,190 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include "common.h"
+#include "object.h"
+
+
+// The object heap: all Obj structs live here (see heap.c), including
+// anything stored inline such as string chars and closure upvalues. The
+// things objects point to, like chunk code, are still allocated with
+// reallocate().
+
+
+#define SLAB_SIZE (64 * 1024)
+#define SLOT_ALIGN 16
+#define SLAB_MAX_SLOT 256
+#define SLAB_BITMAP_WORDS (SLAB_SIZE / SLOT_ALIGN / 64)
+
+
+// The slab and large object headers are here so that the mark bit
+// helpers below can be inlined into the collector; nothing outside
+// heap.c should need their fields.
+typedef struct Slab {
+  struct Slab* next;  // the next slab in the same size class
+  size_t slotSize;
+  int slotCount;
+  // 2^32 / slotSize, rounded up, for turning an offset into a slot index
+  // with a multiply instead of a divide.
+  uint32_t slotReciprocal;
+  // The sweepEpoch as of the last time this slab was swept.
+  unsigned sweptEpoch;
+  // One bit per slot in each: does it hold an object, and is that object
+  // marked.
+  uint64_t allocated[SLAB_BITMAP_WORDS];
+  uint64_t marked[SLAB_BITMAP_WORDS];
+} Slab;
+
+
+// Doubly linked, so that sweeping a young large object can unlink it.
+typedef struct LargeObject {
+  struct LargeObject* next;
+  struct LargeObject* previous;
+  size_t size;
+  bool isMarked;
+} LargeObject;
+
+
+// Round up to a multiple of SLOT_ALIGN.
+#define ALIGN_SLOT(size) (((size) + SLOT_ALIGN - 1) & ~(size_t)(SLOT_ALIGN - 1))
+
+// Slots start right after the slab header.
+#define SLAB_HEADER_SIZE ALIGN_SLOT(sizeof(Slab))
+#define SLAB_SLOT(slab, index) \
+  ((Obj*)((uint8_t*)(slab) + SLAB_HEADER_SIZE + (index) * (slab)->slotSize))
+#define SLAB_OF(object) \
+  ((Slab*)((uintptr_t)(object) & ~(uintptr_t)(SLAB_SIZE - 1)))
+#define SLOT_INDEX(slab, object) \
+  ((int)(((uint64_t)((uint8_t*)(object) - (uint8_t*)SLAB_SLOT(slab, 0)) * \
+	  (slab)->slotReciprocal) >> 32))
+
+#define LARGE_HEADER_SIZE ALIGN_SLOT(sizeof(LargeObject))
+#define LARGE_OBJECT(large) ((Obj*)((uint8_t*)(large) + LARGE_HEADER_SIZE))
+#define LARGE_HEADER(object) \
+  ((LargeObject*)((uint8_t*)(object) - LARGE_HEADER_SIZE))
+
+
+// The total size of the marked objects, and of all objects.
+extern size_t heapMarkedBytes;
+extern size_t heapObjectBytes;
+
+// How much of heapObjectBytes the sweep in progress (if any) has yet to
+// free.
+extern size_t heapUnsweptGarbage;
+
+// Time spent sweeping on allocation rather than in a collection, and
+// on the background sweeper, for --stats.
+extern double heapLazySweepSeconds;
+extern double heapBackgroundSweepSeconds;
+
+
+static inline bool heapIsMarked(Obj* object) {
+  if (object->isLarge) {
+    return LARGE_HEADER(object)->isMarked;
+  }
+  Slab* slab = SLAB_OF(object);
+  int index = SLOT_INDEX(slab, object);
+  return (slab->marked[index / 64] >> (index % 64)) & 1;
+}
+
+
+// Mark an object, returning false if it already was.
+static inline bool heapMark(Obj* object) {
+  if (object->isLarge) {
+    LargeObject* large = LARGE_HEADER(object);
+    if (large->isMarked) {
+      return false;
+    }
+    large->isMarked = true;
+    heapMarkedBytes += large->size;
+    return true;
+  }
+  Slab* slab = SLAB_OF(object);
+  int index = SLOT_INDEX(slab, object);
+  uint64_t bit = (uint64_t)1 << (index % 64);
+  if (slab->marked[index / 64] & bit) {
+    return false;
+  }
+  slab->marked[index / 64] |= bit;
+  heapMarkedBytes += slab->slotSize;
+  return true;
+}
+
+
+// heapMark for the parallel marker: safe to race with other threads
+// marking the same object or its slab neighbours (exactly one of them
+// gets true). The marked size goes to `*marked_bytes` instead, so that
+// each thread can keep its own count.
+static inline bool heapMarkAtomic(Obj* object, size_t* marked_bytes) {
+  if (object->isLarge) {
+    LargeObject* large = LARGE_HEADER(object);
+    if (__atomic_load_n(&large->isMarked, __ATOMIC_RELAXED) ||
+	__atomic_exchange_n(&large->isMarked, true, __ATOMIC_RELAXED)) {
+      return false;
+    }
+    *marked_bytes += large->size;
+    return true;
+  }
+  Slab* slab = SLAB_OF(object);
+  int index = SLOT_INDEX(slab, object);
+  uint64_t bit = (uint64_t)1 << (index % 64);
+  uint64_t* word = &slab->marked[index / 64];
+  // Check first, so that an object that's already marked (the common
+  // case for anything with more than one reference) costs a load rather
+  // than a locked instruction.
+  if ((__atomic_load_n(word, __ATOMIC_RELAXED) & bit) ||
+      (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit)) {
+    return false;
+  }
+  *marked_bytes += slab->slotSize;
+  return true;
+}
+
+
+// Get memory for a new object of `size` bytes, which starts out
+// unmarked. This sets isLarge; the caller initializes the rest of the
+// object. This counts toward the GC threshold and may run a collection
+// first, just like reallocate().
+Obj* heapAllocate(size_t size);
+
+// Give back an object that was never used, such as a fresh string that
+// turned out to be a duplicate of an interned one. The object must not be
+// reachable from anywhere, and must not own any memory.
+void heapFree(Obj* object);
+
+// Start sweeping, once marking is done. This doesn't free anything yet:
+// from now on each size class sweeps its slabs as it gets to them to
+// allocate, and heapSweepSlice / heapFinishSweep sweep the rest.
+// Survivors are unmarked, except in generational mode, where they stay
+// marked, which makes them old.
+void heapStartSweep();
+
+// Sweep about `budget` bytes worth of the heap, and return true once the
+// sweep is done.
+bool heapSweepSlice(size_t budget);
+
+// Sweep whatever the current sweep (if any) has left; marking can only
+// start once this is done.
+void heapFinishSweep();
+
+// Start a sweep and finish it right away.
+void heapSweep();
+
+// From now on, have a background thread start on each sweep as soon as
+// it starts (see heap.c). Not for generational or incremental mode.
+void heapStartSweepThread();
+
+// Generational mode: the objects allocated since the last collection.
+Obj** heapYoungObjects(int* count);
+
+// Generational mode: free the young objects that aren't marked. The
+// marked ones stay marked, so they are old from now on.
+void heapSweepNursery();
+
+// Generational mode: unmark everything, before a full collection.
+void heapClearMarks();
+
+// Free every object (when the vm shuts down).
+void heapFreeAll();
+
+#endif
@@ -9,6 +9,10 @@
 #include "table.h"
 #include "vm.h"
 #include "debug.h"
+#include "memory.h"
+#include "compiler.h"
+#include "cache.h"
+#include "parallel_mark.h"
 
 
 static void repl() {
@@ -54,10 +58,44 @@ static char* readFile(const char* path) {
 }
 
 
-static void runFile(const char* path) {
+/* Compile `source`, going through the bytecode cache that lives next
+   to `path` (see cache.h). Returns NULL on a compile error. */
+static ObjFunction* compileCached(const char* path, const char* source) {
+  size_t length = strlen(path);
+  char* cache_path = (char*)malloc(length + 2);
+  if (cache_path == NULL) {
+    return compile(source);
+  }
+  memcpy(cache_path, path, length);
+  cache_path[length] = 'c';  // foo.lox -> foo.loxc
+  cache_path[length + 1] = '\0';
+
+  ObjFunction* function = NULL;
+  // --dump-bytecode should show the compiler's output, so don't skip it.
+  if (!debugPrintCode) {
+    function = loadBytecodeCache(cache_path, source);
+  }
+  if (function == NULL) {
+    function = compile(source);
+    if (function != NULL) {
+      writeBytecodeCache(cache_path, source, function);
+    }
+  }
+  free(cache_path);
+  return function;
+}
+
+
+static void runFile(const char* path, bool use_cache) {
   char* source = readFile(path);
-  InterpretResult result = interpret(source);
+  ObjFunction* function = use_cache ? compileCached(path, source) : compile(source);
+  InterpretResult result = (function == NULL
+			    ? INTERPRET_COMPILE_ERROR
+			    : interpretFunction(function));
   free(source);
+  if (debugPrintStats) {
+    vmPrintStats();
+  }
 
   if (result == INTERPRET_COMPILE_ERROR) {
     exit(65);
@@ -68,21 +106,132 @@ static void runFile(const char* path) {
 }
 
 
+static void usage() {
+  fprintf(stderr,
+	  "Usage: clox [options] [path]\n"
+	  "\n"
+	  "Options:\n"
+	  "  --trace               print the stack and each instruction as it runs\n"
+	  "  --dump-bytecode       disassemble each function after compiling it\n"
+	  "  --stats               print vm counters to stderr when done\n"
+	  "  --no-cache            don't read or write the bytecode cache\n"
+	  "                        (path + \"c\", e.g. foo.loxc for foo.lox)\n"
+	  "  --gc-threshold=BYTES  heap size that triggers the first GC\n"
+	  "                        (default %d)\n"
+	  "  --gc-grow=FACTOR      after a GC, the next one happens once the\n"
+	  "                        heap grows to FACTOR times what survived\n"
+	  "                        (default %g)\n"
+	  "  --gc-nursery=BYTES    generational mode: collect just the objects\n"
+	  "                        allocated since the last GC every BYTES of\n"
+	  "                        allocation (default 0, which means off)\n"
+	  "  --gc-slice=BYTES      incremental mode: collect in slices of about\n"
+	  "                        BYTES of work each, in between allocations\n"
+	  "                        (default 0, which means off; can't be used\n"
+	  "                        with --gc-nursery)\n"
+	  "  --gc-threads=N        mark with N threads in full collections\n"
+	  "                        (default 1, at most %d)\n"
+	  "  --gc-sweep-thread     sweep in a background thread (can't be\n"
+	  "                        used with --gc-nursery or --gc-slice)\n"
+	  "  --stress-gc           run a GC on every allocation\n",
+	  GC_INITIAL_THRESHOLD, GC_HEAP_GROW_FACTOR, MARK_THREADS_MAX);
+  exit(64);
+}
+
+
+// If `arg` is `--name=value`, return a pointer to the value part.
+static const char* optionValue(const char* arg, const char* name) {
+  size_t length = strlen(name);
+  if (strncmp(arg, name, length) == 0 && arg[length] == '=') {
+    return arg + length + 1;
+  }
+  return NULL;
+}
+
+
 int main(int argc, const char* argv[]) {
+  const char* path = NULL;
+  size_t gc_threshold = GC_INITIAL_THRESHOLD;
+  double gc_grow_factor = GC_HEAP_GROW_FACTOR;
+  bool gc_stress = false;
+  size_t gc_nursery_size = 0;
+  size_t gc_slice_size = 0;
+  long gc_threads = 1;
+  bool gc_sweep_thread = false;
+  bool use_cache = true;
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* value;
+    if ((value = optionValue(arg, "--gc-threshold")) != NULL) {
+      char* end;
+      gc_threshold = strtoull(value, &end, 10);
+      if (*end != '\0' || gc_threshold == 0) {
+	usage();
+      }
+    } else if ((value = optionValue(arg, "--gc-nursery")) != NULL) {
+      char* end;
+      gc_nursery_size = strtoull(value, &end, 10);
+      if (*end != '\0') {
+	usage();
+      }
+    } else if ((value = optionValue(arg, "--gc-slice")) != NULL) {
+      char* end;
+      gc_slice_size = strtoull(value, &end, 10);
+      if (*end != '\0') {
+	usage();
+      }
+    } else if ((value = optionValue(arg, "--gc-threads")) != NULL) {
+      char* end;
+      gc_threads = strtol(value, &end, 10);
+      if (*end != '\0' || gc_threads < 1 || gc_threads > MARK_THREADS_MAX) {
+	usage();
+      }
+    } else if ((value = optionValue(arg, "--gc-grow")) != NULL) {
+      char* end;
+      gc_grow_factor = strtod(value, &end);
+      if (*end != '\0' || gc_grow_factor < 1.0) {
+	usage();
+      }
+    } else if (strcmp(arg, "--trace") == 0) {
+      debugTraceExecution = true;
+    } else if (strcmp(arg, "--dump-bytecode") == 0) {
+      debugPrintCode = true;
+    } else if (strcmp(arg, "--stats") == 0) {
+      debugPrintStats = true;
+    } else if (strcmp(arg, "--gc-sweep-thread") == 0) {
+      gc_sweep_thread = true;
+    } else if (strcmp(arg, "--stress-gc") == 0) {
+      gc_stress = true;
+    } else if (strcmp(arg, "--no-cache") == 0) {
+      use_cache = false;
+    } else if (arg[0] == '-' || path != NULL) {
+      usage();
+    } else {
+      path = arg;
+    }
+  }
+
+  if ((gc_nursery_size > 0) + (gc_slice_size > 0) + gc_sweep_thread > 1) {
+    usage();
+  }
+
   Chunk chunk;
   initChunk(&chunk);
+  initGC(gc_threshold, gc_grow_factor, gc_stress, gc_nursery_size,
+	 gc_slice_size, (int)gc_threads, gc_sweep_thread);
   initVM();
 
-  if (argc == 1) {
+  if (path == NULL) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+    if (debugPrintStats) {
+      vmPrintStats();
+    }
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    runFile(path, use_cache);
   }
 
   freeVM();
+  freeBytecodeCache();
   freeChunk(&chunk);
   return 0;
 }
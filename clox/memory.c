@@ -1,10 +1,13 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "object.h"
 #include "value.h"
 #include "compiler.h"
 #include "vm.h"
+#include "heap.h"
+#include "parallel_mark.h"
 
 #include "memory.h"
 
@@ -18,10 +21,179 @@ int markstackCount = 0;
 Obj** markstack = NULL;
 
 
+// Heap accounting. Similarly to the markstack, these are static data
+// rather than fields on the vm.
+//
+// bytesAllocated only counts memory that goes through reallocate() and
+// the object heap (see heap.c), so it excludes the markstack and the vm
+// struct itself.
+size_t bytesAllocated = 0;
+size_t nextGC = GC_INITIAL_THRESHOLD;
+size_t gcInitialThreshold = GC_INITIAL_THRESHOLD;
+double gcGrowFactor = GC_HEAP_GROW_FACTOR;
+bool gcStress = false;
+size_t gcNurserySize = 0;
+size_t gcSliceSize = 0;
+bool gcBarrierActive = false;
+// Bytes allocated as of the end of the last collection, so that
+// bytesAllocated minus this is (roughly) the size of the nursery.
+static size_t bytesAfterGC = 0;
+// In stress mode with a nursery, every STRESS_FULL_GC_INTERVAL-th
+// collection is a full one.
+#define STRESS_FULL_GC_INTERVAL 8
+static size_t stressCollections = 0;
+
+
+// The remembered set: old objects that may point at young ones. Plain
+// malloc, like the markstack.
+static Obj** rememberedSet = NULL;
+static int rememberedCount = 0;
+static int rememberedCapacity = 0;
+
+
+// Incremental mode: where we are in the current collection, and when the
+// next slice is due.
+typedef enum {
+  GC_IDLE,
+  GC_MARKING,
+  GC_SWEEPING,
+} GCPhase;
+
+static GCPhase gcPhase = GC_IDLE;
+static size_t nextSlice = 0;
+
+// Each slice does gcSliceSize bytes of marking or sweeping after
+// gcSliceSize / GC_SLICE_SPEED bytes of allocation, so that a collection
+// finishes well before the program has allocated as much as is live.
+#define GC_SLICE_SPEED 4
+
+
+// Collection statistics for --stats. The sweeper (see heapSweep)
+// does the object counting.
+static size_t gcCollections = 0;
+static size_t gcYoungCollections = 0;
+static size_t gcIncrementalCollections = 0;
+static size_t gcSlices = 0;
+static double gcMarkSeconds = 0;
+static double gcSweepSeconds = 0;
+static double gcLongestYoungPause = 0;
+static double gcLongestFullPause = 0;
+static double gcLongestSlicePause = 0;
+
+// How many pauses (whole collections, or slices) took under 2us, 2-4us,
+// 4-8us and so on; the last bucket takes everything longer.
+#define GC_PAUSE_BUCKETS 16
+static size_t gcPauseHistogram[GC_PAUSE_BUCKETS];
+size_t gcObjectsSwept = 0;
+size_t gcObjectsFreed = 0;
+
+
+double gcSecondsNow() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+void initGC(size_t initial_threshold, double grow_factor, bool stress,
+	    size_t nursery_size, size_t slice_size, int mark_threads,
+	    bool sweep_thread) {
+  gcInitialThreshold = initial_threshold;
+  gcGrowFactor = grow_factor;
+  gcStress = stress;
+  gcNurserySize = nursery_size;
+  gcSliceSize = slice_size;
+  gcBarrierActive = nursery_size > 0;
+  nextGC = initial_threshold;
+  initParallelMark(mark_threads);
+  if (sweep_thread) {
+    heapStartSweepThread();
+  }
+}
+
+
+static void recordPause(double seconds) {
+  int bucket = 0;
+  for (double limit = 2e-6; seconds >= limit && bucket < GC_PAUSE_BUCKETS - 1;
+       limit *= 2) {
+    bucket++;
+  }
+  gcPauseHistogram[bucket]++;
+}
+
+
+static void collectYoung();
+static void collectSlice();
+
+
+void trackAllocation(size_t old_size, size_t new_size) {
+  // Account first, so that a collection triggered here sees the
+  // allocation we're about to make as part of the heap.
+  bytesAllocated += new_size;
+  bytesAllocated -= old_size;
+  if (new_size > old_size) {
+    // Garbage that a lazy sweep hasn't got to yet doesn't count.
+    size_t heap_size = bytesAllocated - heapUnsweptGarbage;
+    if (gcSliceSize > 0) {
+      if (gcStress ||
+	  (gcPhase == GC_IDLE ? heap_size > nextGC
+	                      : bytesAllocated > nextSlice)) {
+	collectSlice();
+      }
+    } else if (gcStress) {
+      if (gcNurserySize > 0 &&
+	  ++stressCollections % STRESS_FULL_GC_INTERVAL != 0) {
+	collectYoung();
+      } else {
+	collectGarbage();
+      }
+    } else if (heap_size > nextGC) {
+      collectGarbage();
+    } else if (gcNurserySize > 0 &&
+	       bytesAllocated > bytesAfterGC + gcNurserySize) {
+      collectYoung();
+    }
+  }
+}
+
+
+static void rememberObject(Obj* object) {
+  if (rememberedCapacity < rememberedCount + 1) {
+    rememberedCapacity = GROW_CAPACITY(rememberedCapacity);
+    rememberedSet = (Obj**)realloc(rememberedSet,
+				   sizeof(Obj*) * rememberedCapacity);
+    if (rememberedSet == NULL) {
+      fprintf(stderr, "clox: out of memory inside the remembered set, exiting now %s:%d", __FILE__, __LINE__);
+      exit(1);
+    }
+  }
+  object->isRemembered = true;
+  rememberedSet[rememberedCount++] = object;
+}
+
+
+void writeBarrierSlow(Obj* owner, Obj* value) {
+  if (!heapIsMarked(owner) || heapIsMarked(value)) {
+    return;
+  }
+  if (gcNurserySize > 0) {
+    rememberObject(owner);
+  } else if (gcPhase == GC_MARKING) {
+    markObject(value);
+  }
+}
+
+
+static void forgetRememberedSet() {
+  for (int i = 0; i < rememberedCount; i++) {
+    rememberedSet[i]->isRemembered = false;
+  }
+  rememberedCount = 0;
+}
+
+
 void* reallocate(void* pointer, size_t old_size, size_t new_size) {
-  #ifdef DEBUG_STRESS_GC
-  if (new_size > old_size) { collectGarbage(); }
-  #endif
+  trackAllocation(old_size, new_size);
   if (new_size == 0) {
     free(pointer);
     return NULL;
@@ -55,7 +227,7 @@ void addToMarkstack(Obj* object) {
 
 
 void markObject(Obj* object) {
-  if (object == NULL || object->isMarked) {
+  if (object == NULL || !heapMark(object)) {
     return;
   }
 #ifdef DEBUG_LOG_GC
@@ -63,7 +235,6 @@ void markObject(Obj* object) {
   printValue(OBJ_VAL(object));
   printf("\n");
 #endif
-  object->isMarked = true;
   // add to the worklist (the book calls this the "grey stack")
   addToMarkstack(object);
 }
@@ -90,40 +261,19 @@ void markValueArray(ValueArray* array) {
 }
 
 
+static void markReference(void* context, Obj* reference) {
+  (void)context;
+  markObject(reference);
+}
+
+
 void traceObjectReferences(Obj* object) {
 #ifdef DEBUG_LOG_GC
   printf("        %p trace-object-references ", (void*)object);
   printValue(OBJ_VAL(object));
   printf("\n");
 #endif
-  switch(object->type) {
-  case OBJ_STRING:
-    // Strings don't contain references to other objects; they do
-    // contain data but it's all in the intern table which is
-    // special-cased.
-    break;
-  case OBJ_UPVALUE: {
-    markValue(((ObjUpvalue*)object)->closed);  // (this is just NIL if open)
-    break;
-  }
-  case OBJ_FUNCTION: {
-    // Functions contain:
-    // - a string for their name
-    // - an array of constants (this is most of the compiler-generated data)
-    ObjFunction* function = (ObjFunction*)object;
-    markObject((Obj*)function->name);
-    markValueArray(&function->chunk.constants);
-    break;
-  }
-  case OBJ_CLOSURE: {
-    ObjClosure* closure = (ObjClosure*)object;
-    markObject((Obj*)closure->function);
-    for (int i=0; i < closure->upvalueCount; i++) {
-      markObject((Obj*)closure->upvalues[i]);
-    }
-    break;
-  }
-  }
+  forEachReference(object, markReference, NULL);
 }
 
 
@@ -135,12 +285,226 @@ static void traceReferences() {
 }
 
 
+// Like traceReferences, but stop after tracing about `budget` bytes
+// worth of objects. Returns true once the markstack is empty.
+static bool traceSlice(size_t budget) {
+  size_t work = 0;
+  while (markstackCount > 0 && work < budget) {
+    Obj* object = markstack[--markstackCount];
+    traceObjectReferences(object);
+    work += objectSize(object);
+  }
+  return markstackCount == 0;
+}
+
+
+/* Generational mode.
+
+   Objects are young until they survive a collection, and old after
+   that. We don't move anything (C code all over the vm holds raw Obj*
+   pointers across allocations), so rather than a copying nursery, young
+   objects are the ones allocated since the last collection: heap.c keeps
+   a list of them.
+
+   We use "sticky" mark bits: survivors keep their mark bit, so outside of
+   a collection, marked means old. A young collection then works almost
+   like a full one:
+   - marking skips marked (old) objects, so it only traces young ones;
+   - the old objects in the remembered set get traced too, since they may
+     point at young objects that nothing else reaches;
+   - the sweep only visits the young objects, and the survivors keep
+     their marks, which promotes them.
+   So a young collection costs about as much as the roots plus the young
+   objects, however big the old generation is.
+
+   A full collection clears every mark first and then proceeds as usual,
+   except that the survivors keep their marks, so they are all old.
+*/
+static void collectYoung() {
+  GC_LOG("------ YOUNG GC BEGIN ------\n");
+  double start = gcSecondsNow();
+  markRoots();
+  for (int i = 0; i < rememberedCount; i++) {
+    addToMarkstack(rememberedSet[i]);
+  }
+  forgetRememberedSet();
+  traceReferences();
+  double marked = gcSecondsNow();
+  sweepVmNursery();
+  double end = gcSecondsNow();
+  gcCollections++;
+  gcYoungCollections++;
+  gcMarkSeconds += marked - start;
+  gcSweepSeconds += end - marked;
+  if (end - start > gcLongestYoungPause) {
+    gcLongestYoungPause = end - start;
+  }
+  recordPause(end - start);
+  bytesAfterGC = bytesAllocated;
+  GC_LOG("------ YOUNG GC END (%zu remain) ------\n", bytesAllocated);
+}
+
+
+// Schedule the next collection relative to what survived this one.
+static void scheduleNextGC(size_t live_bytes) {
+  nextGC = (size_t)(live_bytes * gcGrowFactor);
+  if (nextGC < gcInitialThreshold) {
+    nextGC = gcInitialThreshold;
+  }
+}
+
+
 void collectGarbage() {
   GC_LOG("------ GC BEGIN ------\n");
+#ifdef DEBUG_LOG_GC
+  size_t before = bytesAllocated;
+#endif
+  double start = gcSecondsNow();
+  // Marking needs the last sweep to be over (see heap.c).
+  heapFinishSweep();
+  double swept = gcSecondsNow();
+  if (gcNurserySize > 0) {
+    // Everything is about to be traced, old or not.
+    heapClearMarks();
+    forgetRememberedSet();
+  }
   markRoots();
   GC_LOG("  ---- mark roots / trace ----\n");
-  traceReferences();
+  if (markThreadCount > 1) {
+    parallelTrace(markstack, markstackCount);
+    markstackCount = 0;
+  } else {
+    traceReferences();
+  }
+  double marked = gcSecondsNow();
+  // Whatever isn't marked now is garbage.
+  size_t live_bytes = bytesAllocated - (heapObjectBytes - heapMarkedBytes);
   GC_LOG("  ---- trace / sweep ----\n");
-  sweepVmObjects();
-  GC_LOG("------ GC END ------\n");
+  if (gcNurserySize > 0) {
+    sweepVmObjects();
+  } else {
+    // Leave the heap to be swept lazily.
+    sweepVmStrings();
+    heapStartSweep();
+  }
+  double end = gcSecondsNow();
+  gcCollections++;
+  gcMarkSeconds += marked - swept;
+  gcSweepSeconds += (swept - start) + (end - marked);
+  if (end - start > gcLongestFullPause) {
+    gcLongestFullPause = end - start;
+  }
+  recordPause(end - start);
+  bytesAfterGC = bytesAllocated;
+  scheduleNextGC(live_bytes);
+  GC_LOG("------ GC END (collected %zu bytes, %zu remain, next at %zu) ------\n",
+	 before - bytesAllocated, bytesAllocated, nextGC);
+}
+
+
+/* Incremental mode.
+
+   A collection is spread over many short slices, which run as the
+   program allocates. It's the usual tri-color scheme: white objects are
+   unmarked, gray ones are marked and still on the markstack, and black
+   ones are marked and traced. The first slice marks the roots; each
+   slice after that traces up to gcSliceSize bytes of gray objects.
+
+   The program keeps running in between, so it can store a pointer to a
+   white object into a black one, and then drop every other path to it;
+   nothing would trace it again. writeBarrier prevents that by marking
+   the white object (graying it). Roots don't have a barrier (the vm
+   writes its stack and globals constantly), so once the markstack runs
+   dry we mark the roots again and trace whatever that finds, all in one
+   slice. New objects start out white: they only survive if that last
+   step finds them.
+
+   Then the sweep runs a slice at a time too (see heap.c), and unmarks
+   what it keeps. The dead strings have to go from the intern table
+   before it starts, in the same slice that finished marking.
+
+   So the pause times are bounded by the slice size, apart from marking
+   the roots (twice) and clearing the intern table. If the program
+   allocates so fast that the heap grows past gcGrowFactor times the
+   threshold mid-collection, slices stop being limited until the
+   collection is over.
+*/
+static void collectSlice() {
+  double start = gcSecondsNow();
+  size_t budget = gcSliceSize;
+  if (bytesAllocated > nextGC * gcGrowFactor) {
+    budget = (size_t)-1;
+  }
+  if (gcPhase == GC_IDLE) {
+    GC_LOG("------ INCREMENTAL GC BEGIN ------\n");
+    markRoots();
+    gcPhase = GC_MARKING;
+    gcBarrierActive = true;
+  }
+  GCPhase phase = gcPhase;
+  if (phase == GC_MARKING) {
+    if (traceSlice(budget)) {
+      GC_LOG("  ---- remark roots / sweep ----\n");
+      markRoots();
+      traceReferences();
+      sweepVmStrings();
+      heapStartSweep();
+      gcPhase = GC_SWEEPING;
+      gcBarrierActive = false;
+    }
+  } else if (heapSweepSlice(budget)) {
+    gcPhase = GC_IDLE;
+    gcCollections++;
+    gcIncrementalCollections++;
+    scheduleNextGC(bytesAllocated);
+    GC_LOG("------ INCREMENTAL GC END (%zu remain, next at %zu) ------\n",
+	   bytesAllocated, nextGC);
+  }
+  nextSlice = bytesAllocated + gcSliceSize / GC_SLICE_SPEED;
+  double end = gcSecondsNow();
+  gcSlices++;
+  if (phase == GC_MARKING) {
+    gcMarkSeconds += end - start;
+  } else {
+    gcSweepSeconds += end - start;
+  }
+  if (end - start > gcLongestSlicePause) {
+    gcLongestSlicePause = end - start;
+  }
+  recordPause(end - start);
+}
+
+
+void printGCStats() {
+  fprintf(stderr, "gc: %zu collections (%zu young, %zu incremental in %zu slices)\n",
+	  gcCollections, gcYoungCollections, gcIncrementalCollections, gcSlices);
+  fprintf(stderr, "gc: mark %.2fms, sweep %.2fms (+%.2fms lazily, +%.2fms in the background)\n",
+	  gcMarkSeconds * 1e3, gcSweepSeconds * 1e3,
+	  heapLazySweepSeconds * 1e3, heapBackgroundSweepSeconds * 1e3);
+  if (markThreadCount > 1) {
+    fprintf(stderr, "gc: marked with %d threads, %zu objects stolen\n",
+	    markThreadCount, markObjectsStolen);
+  }
+  fprintf(stderr, "gc: longest pause %.2fms full, %.2fms young, %.2fms slice\n",
+	  gcLongestFullPause * 1e3, gcLongestYoungPause * 1e3,
+	  gcLongestSlicePause * 1e3);
+  fprintf(stderr, "gc: pauses");
+  double limit = 2e-6;
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++, limit *= 2) {
+    if (gcPauseHistogram[i] == 0) {
+      continue;
+    }
+    if (i == GC_PAUSE_BUCKETS - 1) {
+      fprintf(stderr, " >=%gus:%zu", limit / 2 * 1e6, gcPauseHistogram[i]);
+    } else {
+      fprintf(stderr, " <%gus:%zu", limit * 1e6, gcPauseHistogram[i]);
+    }
+  }
+  fprintf(stderr, "\n");
+  double sweep_seconds =
+    gcSweepSeconds + heapLazySweepSeconds + heapBackgroundSweepSeconds;
+  if (sweep_seconds > 0) {
+    fprintf(stderr, "gc: swept %zu objects (%zu freed), %.1fM objects/s\n",
+	    gcObjectsSwept, gcObjectsFreed, gcObjectsSwept / sweep_seconds / 1e6);
+  }
 }
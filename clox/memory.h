@@ -15,21 +15,67 @@
 
 
 #define FREE_ARRAY(type, pointer, old_count) \
-  reallocate(pointer, sizeof(type*) * (old_count), 0)
+  reallocate(pointer, sizeof(type) * (old_count), 0)
+
+
+// Heap accounting defaults. We collect once the bytes allocated through
+// reallocate() cross a threshold, and after each collection the threshold
+// becomes the surviving heap size times the growth factor (but never less
+// than the initial threshold, so tiny heaps don't collect constantly).
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2.0
 
 
 void* reallocate(void* pointer, size_t old_size, size_t new_size);
 
+// Record that an allocation changed size from old_size to new_size
+// bytes, collecting first if it grows the heap past the GC threshold.
+// reallocate() does this for you; it's exposed for heap.c.
+void trackAllocation(size_t old_size, size_t new_size);
+
+// Configure the collector; this should happen before initVM(). Passing
+// `stress` collects on every growing allocation, which is slow but
+// very good at shaking out missing GC roots. A non-zero `nursery_size`
+// turns on generational mode, collecting just the young objects after
+// every that many bytes of allocation. A non-zero `slice_size` instead
+// turns on incremental mode, where collections proceed in slices of
+// about that many bytes of work; with `stress`, a slice runs on every
+// growing allocation. The two modes don't mix. With `mark_threads`
+// above 1, full collections trace the heap with that many threads (see
+// parallel_mark.c), and with `sweep_thread`, a background thread does
+// most of the sweeping (see heap.c; this can't be used with either
+// mode).
+void initGC(size_t initial_threshold, double grow_factor, bool stress,
+	    size_t nursery_size, size_t slice_size, int mark_threads,
+	    bool sweep_thread);
+
+// Non-zero in generational mode.
+extern size_t gcNurserySize;
+
+// Non-zero in incremental mode.
+extern size_t gcSliceSize;
+
 // why are these exposed? Because we rely on inlined mark helpers
 // for table.c and compiler.c that need access to them.
 
 void markObject(Obj* object);
 void markValue(Value value);
 
+// Collect the whole heap.
 void collectGarbage();
 
+// The clock the collector times itself with, in seconds.
+double gcSecondsNow();
+
+// Counted by the sweeper, for printGCStats.
+extern size_t gcObjectsSwept;
+extern size_t gcObjectsFreed;
+
+// Print collection counts and timings (for --stats).
+void printGCStats();
+
 #define ALLOCATE(type, size) \
-  reallocate(NULL, 0, sizeof(type) * size)
+  reallocate(NULL, 0, sizeof(type) * (size))
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
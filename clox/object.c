@@ -1,9 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
 #include "value.h"
 #include "vm.h"
+#include "heap.h"
 
 #include "object.h"
 
@@ -14,15 +16,15 @@ const char* typeName(ObjType type) {
   case OBJ_FUNCTION: return "OBJ_FUNCTION";
   case OBJ_CLOSURE: return "OBJ_CLOSURE";
   case OBJ_UPVALUE: return "OBJ_UPVALUE";
+  case OBJ_ROPE: return "OBJ_ROPE";
   }
 }
 
 static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
+  Obj* object = heapAllocate(size);
   object->type = type;
-  object->isMarked = false;
+  object->isRemembered = false;
   GC_LOG("%p allocate (size %zu) of type %s\n", (void*)object, size, typeName(type));
-  vmInsertObjectIntoHeap(object);
   return object;
 }
 
@@ -34,8 +36,12 @@ static Obj* allocateObject(size_t size, ObjType type) {
 Table interned_strings;
 
 
+// Strings at least this long are hashed a word at a time.
+#define HASH_WORDS_MIN_LENGTH 16
+
+
 /* Implement FNV-1a hash */
-uint32_t hashChars(const char* key, int length) {
+static uint32_t hashBytes(const char* key, int length) {
   uint32_t hash = 2166136261u;
   for (int i = 0; i < length; i++) {
     hash ^= (uint8_t) key[i];
@@ -45,20 +51,71 @@ uint32_t hashChars(const char* key, int length) {
 }
 
 
-ObjString* allocateString(char* chars, int length) {
-  uint32_t hash = hashChars(chars, length);
-  ObjString* string = vmFindInternedString(chars, length, hash);
-  if (string == NULL) {
-    string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->chars = chars;
-    string->length = length;
-    string->hash = hashChars(chars, length);
-    // adding the string to the table could trigger a GC, so guard
-    // with a push / pop.
-    push(OBJ_VAL(string));
-    vmAddInternedString(string);
-    pop();
+/* Hash 8 bytes per step. Each step folds a word into the state and then
+   scrambles it with a multiply and a shift, which is enough to spread
+   every input bit over the high half. The final ragged word is loaded
+   overlapping the previous one so that there is no byte-by-byte tail.
+
+   This is several times faster than FNV-1a on long strings (the results
+   of repeated concatenation, mostly), but FNV-1a wins on short ones like
+   identifiers, so hashChars picks by length. */
+static uint32_t hashWords(const char* key, int length) {
+  const uint64_t multiplier = 0x9e3779b97f4a7c15ull;
+  uint64_t hash = (uint64_t)length * multiplier;
+  uint64_t word;
+  int i = 0;
+  for (; i + 8 <= length; i += 8) {
+    memcpy(&word, key + i, 8);
+    hash = (hash ^ word) * multiplier;
+    hash ^= hash >> 29;
+  }
+  if (i < length) {
+    memcpy(&word, key + length - 8, 8);
+    hash = (hash ^ word) * multiplier;
+    hash ^= hash >> 29;
+  }
+  hash *= multiplier;
+  return (uint32_t)(hash >> 32);
+}
+
+
+uint32_t hashChars(const char* key, int length) {
+  if (length < HASH_WORDS_MIN_LENGTH) {
+    return hashBytes(key, length);
   }
+  return hashWords(key, length);
+}
+
+
+#define STRING_SIZE(length) (sizeof(ObjString) + (length) + 1)
+
+
+// Allocate a string with room for `length` chars, which the caller
+// has to fill in. It isn't interned yet.
+static ObjString* allocateString(int length) {
+  ObjString* string = (ObjString*)allocateObject(STRING_SIZE(length), OBJ_STRING);
+  string->length = length;
+  string->chars[length] = '\0';
+  return string;
+}
+
+
+// Intern a string that the caller just filled in, unless we already have
+// it; in that case the fresh string is a duplicate and goes straight back
+// to the heap.
+static ObjString* internString(ObjString* string) {
+  uint32_t hash = hashChars(string->chars, string->length);
+  ObjString* interned = vmFindInternedString(string->chars, string->length, hash);
+  if (interned != NULL) {
+    heapFree((Obj*)string);
+    return interned;
+  }
+  string->hash = hash;
+  // adding the string to the table could trigger a GC, so guard
+  // with a push / pop.
+  push(OBJ_VAL(string));
+  vmAddInternedString(string);
+  pop();
   return string;
 }
 
@@ -71,10 +128,121 @@ ObjString* allocateString(char* chars, int length) {
 // lifetime handling and to let us ensure all strings can be passed
 // to C library functions expecting C-strings.
 ObjString* createString(const char* segment_start, int length) {
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, segment_start, length);
-  chars[length] = '\0';
-  return allocateString(chars, length);
+  // Look for an interned copy first, which saves allocating at all when
+  // there is one (e.g. the compiler looking up an identifier).
+  uint32_t hash = hashChars(segment_start, length);
+  ObjString* string = vmFindInternedString(segment_start, length, hash);
+  if (string != NULL) {
+    return string;
+  }
+  string = allocateString(length);
+  memcpy(string->chars, segment_start, length);
+  string->hash = hash;
+  push(OBJ_VAL(string));
+  vmAddInternedString(string);
+  pop();
+  return string;
+}
+
+
+// Concatenations at least this long make a rope instead of copying.
+// Below this, copying is cheap and interning the result right away means
+// equality stays a pointer comparison.
+#define ROPE_MIN_LENGTH 256
+
+
+// Where the chars of a rope child (a string or a rope) are, if they are
+// in one piece.
+static ObjString* flatPart(Obj* object) {
+  if (object->type == OBJ_STRING) {
+    return (ObjString*)object;
+  }
+  return ((ObjRope*)object)->flat;
+}
+
+
+static int partLength(Obj* object) {
+  if (object->type == OBJ_STRING) {
+    return ((ObjString*)object)->length;
+  }
+  return ((ObjRope*)object)->length;
+}
+
+
+// Copy the chars of a rope into `dest`, which has room for rope->length.
+//
+// Ropes built in a loop are as deep as the loop is long, so this walks
+// the tree with an explicit stack rather than recursing. It fills `dest`
+// from the end, visiting right children first: for the usual left-leaning
+// rope (`s = s + piece`) that keeps the stack tiny.
+//
+// Like the markstack, the stack uses plain malloc: this mustn't collect.
+static void copyRopeChars(ObjRope* rope, char* dest) {
+  int capacity = 16;
+  int count = 0;
+  Obj** stack = (Obj**)malloc(sizeof(Obj*) * capacity);
+  if (stack == NULL) {
+    fprintf(stderr, "clox: out of memory, exiting now %s:%d", __FILE__, __LINE__);
+    exit(1);
+  }
+  char* end = dest + rope->length;
+  stack[count++] = (Obj*)rope;
+  while (count > 0) {
+    Obj* part = stack[--count];
+    ObjString* flat = flatPart(part);
+    if (flat != NULL) {
+      end -= flat->length;
+      memcpy(end, flat->chars, flat->length);
+      continue;
+    }
+    if (count + 2 > capacity) {
+      capacity *= 2;
+      stack = (Obj**)realloc(stack, sizeof(Obj*) * capacity);
+      if (stack == NULL) {
+	fprintf(stderr, "clox: out of memory, exiting now %s:%d", __FILE__, __LINE__);
+	exit(1);
+      }
+    }
+    stack[count++] = ((ObjRope*)part)->left;
+    stack[count++] = ((ObjRope*)part)->right;
+  }
+  free(stack);
+}
+
+
+ObjString* flattenString(Value value) {
+  if (IS_STRING(value)) {
+    return AS_STRING(value);
+  }
+  ObjRope* rope = AS_ROPE(value);
+  if (rope->flat == NULL) {
+    // The rope keeps its children alive while we allocate.
+    ObjString* string = allocateString(rope->length);
+    copyRopeChars(rope, string->chars);
+    rope->flat = internString(string);
+    writeBarrier((Obj*)rope, OBJ_VAL(rope->flat));
+    rope->left = NULL;
+    rope->right = NULL;
+  }
+  return rope->flat;
+}
+
+
+static void printRope(ObjRope* rope) {
+  if (rope->flat != NULL) {
+    printf("\"%s\"", rope->flat->chars);
+    return;
+  }
+  // Printing doesn't need an interned string, so copy into a scratch
+  // buffer instead of flattening; that way printing never collects.
+  char* chars = (char*)malloc(rope->length);
+  if (chars == NULL) {
+    fprintf(stderr, "clox: out of memory, exiting now %s:%d", __FILE__, __LINE__);
+    exit(1);
+  }
+  copyRopeChars(rope, chars);
+  printf("\"%.*s\"", rope->length, chars);
+  free(chars);
 }
 
 
@@ -101,6 +269,10 @@ void printObject(Value value) {
     printf("(upvalue)");
     break;
   }
+  case OBJ_ROPE: {
+    printRope(AS_ROPE(value));
+    break;
+  }
   case OBJ_CLOSURE: {
     ObjClosure* closure = AS_CLOSURE(value);
     printf("closure(");
@@ -113,6 +285,16 @@ void printObject(Value value) {
 
 
 bool objectEqual(Value value0, Value value1) {
+  if (isAnyString(value0) && isAnyString(value1) &&
+      (IS_ROPE(value0) || IS_ROPE(value1))) {
+    // Strings of different lengths can't be equal, so only flatten when
+    // we have to. The flattened strings are interned, so then it's
+    // just a pointer comparison.
+    if (partLength(AS_OBJ(value0)) != partLength(AS_OBJ(value1))) {
+      return false;
+    }
+    return flattenString(value0) == flattenString(value1);
+  }
   if (OBJ_TYPE(value0) != OBJ_TYPE(value1)) {
     return false;
   }
@@ -132,19 +314,37 @@ bool objectEqual(Value value0, Value value1) {
 }
 
 
+static ObjRope* newRope(Obj* left, Obj* right) {
+  ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+  rope->length = partLength(left) + partLength(right);
+  // Point at the flattened version of a child when there is one, so the
+  // old tree can be collected.
+  ObjString* flat_left = flatPart(left);
+  ObjString* flat_right = flatPart(right);
+  rope->left = flat_left != NULL ? (Obj*)flat_left : left;
+  rope->right = flat_right != NULL ? (Obj*)flat_right : right;
+  rope->flat = NULL;
+  return rope;
+}
+
+
+// Long results become a rope, so that building a string up with `+` in
+// a loop copies each piece once (when the rope is flattened) instead of
+// copying the whole string so far on every iteration.
 Value concatenateStrings(Value left, Value right) {
+  if (partLength(AS_OBJ(left)) + partLength(AS_OBJ(right)) >= ROPE_MIN_LENGTH) {
+    return OBJ_VAL(newRope(AS_OBJ(left), AS_OBJ(right)));
+  }
+  // Anything shorter than ROPE_MIN_LENGTH is made of flat strings.
   ObjString* lstr = AS_STRING(left);
   ObjString* rstr = AS_STRING(right);
 
-  int length = lstr->length + rstr->length;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, lstr->chars, lstr->length);
-  memcpy(chars + lstr->length, rstr->chars, rstr->length);
-  chars[length] = '\0';
-
-  // Wrap the chars in a string struct, and return a Value pointing to it.
-  ObjString* string = allocateString(chars, length);
-  Value value = OBJ_VAL(string);
+  // Build the result in place, then intern it. The operands are still on
+  // the vm stack, so they survive if allocating triggers a GC.
+  ObjString* string = allocateString(lstr->length + rstr->length);
+  memcpy(string->chars, lstr->chars, lstr->length);
+  memcpy(string->chars + lstr->length, rstr->chars, rstr->length);
+  Value value = OBJ_VAL(internString(string));
   return value;
 }
 
@@ -160,6 +360,7 @@ ObjFunction* newFunction() {
   function->arity = 0;
   function->name = NULL;
   function->upvalueCount = 0;
+  function->maxStack = 0;
   initChunk(&function->chunk);
   return function;
 }
@@ -168,7 +369,6 @@ ObjFunction* newFunction() {
 ObjUpvalue* newUpvalue(Value* value) {
   ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->location = value;
-  upvalue->next = NULL;
   upvalue->closed = NIL_VAL;
   return upvalue;
 }
@@ -181,54 +381,60 @@ ObjUpvalue* newUpvalue(Value* value) {
 
    The purpose of the wrapper is to have a place for upvalues. */
 ObjClosure* newClosure(ObjFunction* function) {
-  // The upvalue count is known statically, so we can pre-allocate
-  // and pre-initialize the pointer slots here.
+  // The upvalue count is known statically, so the array of upvalues is
+  // allocated inline with the closure, and pre-initialized here.
   //
   // The contents will be filled out as part of the same OP_CLOSURE
   // execution where we construct this, but that has to be done inside
-  // of run() so we can access the vm stack.
-  //
-  // Note that this has to run *before* we allocate the closure,
-  // because the ALLOCATE could trigger a GC so we don't want
-  // the closure to already exist in the heap.
-  //
-  // Note that this is an empty array of ObjUpvalue* _pointers_,
-  // there are no actual objects here. So therere's no risk of the
-  // upvalues being GC'd, they don't exist yet :)
-  ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
-  for (int i = 0; i < function->upvalueCount; i++) {
-    upvalues[i] = NULL;
-  }
-  // Now that there will be no more ALLOCATE calls, we can go ahead
-  // and create the closure.
-  ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  // of run() so we can access the vm stack. Until then they have to be
+  // nil, since filling them in can trigger a GC that traces the closure.
+  ObjClosure* closure = (ObjClosure*)allocateObject(
+      sizeof(ObjClosure) + sizeof(Value) * function->upvalueCount,
+      OBJ_CLOSURE);
   closure->function = function;
-  closure->upvalues = upvalues;
   closure->upvalueCount = function->upvalueCount;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    closure->upvalues[i] = NIL_VAL;
+  }
   return closure;
 }
 
 
+size_t objectSize(Obj* object) {
+  switch (object->type) {
+  case OBJ_STRING: return STRING_SIZE(((ObjString*)object)->length);
+  case OBJ_FUNCTION: return sizeof(ObjFunction);
+  case OBJ_CLOSURE:
+    return sizeof(ObjClosure) +
+      sizeof(Value) * ((ObjClosure*)object)->upvalueCount;
+  case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+  case OBJ_ROPE: return sizeof(ObjRope);
+  }
+  return 0;
+}
+
+
+// Free the memory an object owns. The object's own memory belongs to
+// the heap (see heap.c), which calls this when it frees the object.
 void freeObject(Obj* object) {
   GC_LOG("%p free type %s\n", (void*)object, typeName(object->type));
   switch (object->type) {
   case OBJ_STRING: {
-    ObjString* string = (ObjString*) object;
-    FREE_ARRAY(char, string->chars, string->length + 1);
-    FREE(ObjString, string);
+    // The chars are inline, so they go with the string.
+    break;
+  }
+  case OBJ_ROPE: {
+    // The children and the flattened string are objects in their own
+    // right; the GC handles them.
     break;
   }
   case OBJ_FUNCTION: {
     ObjFunction* function = (ObjFunction*) object;
     freeChunk(&function->chunk);
-    FREE(ObjFunction, function);
     break;
   }
   case OBJ_UPVALUE: {
-    ObjUpvalue* upvalue = (ObjUpvalue*) object;
-    // Do *not* free the next upvalue: the VM owns the linked
-    // list and will handle lifetimes!
-    FREE(ObjUpvalue, upvalue);
+    // Nothing: an upvalue doesn't own what it points to.
     break;
   }
   case OBJ_CLOSURE: {
@@ -239,8 +445,9 @@ void freeObject(Obj* object) {
     // for the entire vm lifetime.
     //
     // omitted code: FREE(ObjFunction, closure->function);
-    FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-    FREE(ObjClosure, closure);
+    //
+    // The upvalue pointers are inline, so they go with the closure.
+    (void) closure;
     break;
   }
   }
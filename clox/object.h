@@ -12,6 +12,7 @@ typedef enum {
   OBJ_FUNCTION,
   OBJ_CLOSURE,
   OBJ_UPVALUE,
+  OBJ_ROPE,
 } ObjType;
 
 
@@ -33,20 +34,31 @@ const char* typeName(ObjType type);
 
 
 // Note the non-typedef form here - the typedef was a forward declaration in value.h
+//
+// There's no list of all objects: they live in slabs (see heap.c), and
+// the sweep walks those. Mark bits live in the slabs too, so isLarge
+// (set by the heap) says where to look for this object's.
+//
+// In generational mode (see memory.c), the mark bit stays set on objects
+// that survive a collection, and doubles as "this object is old".
+// isRemembered is set while an old object is in the remembered set.
 struct Obj {
   ObjType type;
-  bool isMarked;
-  Obj* next;  // objects form a linked list so the vm can keep track of all heap data
+  bool isLarge;
+  bool isRemembered;
 };
 
 
 
 // Note the non-typedef form here - the typedef was a forward declaration in value.h
+//
+// The chars are allocated inline, after the struct, and are always
+// '\0'-terminated so that they can be passed to C library functions.
 struct ObjString {
   Obj obj;
   int length;
-  char* chars;
   uint32_t hash;
+  char chars[];
 };
 
 
@@ -60,6 +72,10 @@ typedef struct {
   Chunk chunk;
   ObjString* name;
   int upvalueCount;
+  // The most stack slots a call uses, from slot 0 (the callee) up,
+  // which the compiler works out so that the vm only has to check for
+  // room once per call.
+  int maxStack;
 } ObjFunction;
 
 
@@ -68,17 +84,33 @@ typedef struct ObjUpvalue {
   Value* location;
   // This is only populated for closed upvalues - it starts out nil.
   Value closed;
-  // Hook for the vm to create a linked list of open upvalues that
-  // haven't yet been moved to the heap.
-  struct ObjUpvalue* next;
 } ObjUpvalue;
 
 
+// A string made by concatenation that hasn't been copied yet (see
+// concatenateStrings). Each side is an ObjString or another ObjRope.
+//
+// As far as Lox is concerned, a rope is just a string. It gets flattened
+// into an interned ObjString, cached in `flat`, once something needs its
+// chars as one piece; the children are dropped at that point.
+typedef struct {
+  Obj obj;
+  int length;
+  Obj* left;
+  Obj* right;
+  ObjString* flat;
+} ObjRope;
+
+
+// The upvalues are allocated inline, after the struct (see newClosure).
+// Each is either an ObjUpvalue, for a variable that's assigned to after
+// its declaration, or else just the variable's value: nothing can change
+// it, so a copy is as good as sharing it (see CaptureKind in chunk.h).
 typedef struct {
   Obj obj;
   ObjFunction* function;
-  ObjUpvalue** upvalues;
   int upvalueCount;
+  Value upvalues[];
 } ObjClosure;
 
 
@@ -102,23 +134,60 @@ static inline bool isObjType(Value value, ObjType type) {
 
 #define IS_STRING(value) (isObjType(value, OBJ_STRING))
 #define IS_FUNCTION(value) (isObjType(value, OBJ_FUNCTION))
-#define IS_UPVALUE(value) (isObjType(value, OBJ_CLOSURE))
+#define IS_UPVALUE(value) (isObjType(value, OBJ_UPVALUE))
 #define IS_CLOSURE(value) (isObjType(value, OBJ_CLOSURE))
+#define IS_ROPE(value) (isObjType(value, OBJ_ROPE))
+
+// Whether a value is a string as far as Lox is concerned, flat or not.
+static inline bool isAnyString(Value value) {
+  return IS_OBJ(value) &&
+    (OBJ_TYPE(value) == OBJ_STRING || OBJ_TYPE(value) == OBJ_ROPE);
+}
 
 
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
-#define AS_UPVALUE(value) ((ObjClosure*)AS_OBJ(value))
+#define AS_UPVALUE(value) ((ObjUpvalue*)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
+
+
+// The slow path of writeBarrier, in memory.c, and whether we need it
+// at all: only in generational mode, or while an incremental collection
+// is marking.
+void writeBarrierSlow(Obj* owner, Obj* value);
+extern bool gcBarrierActive;
+
+/* Call this after storing `value` into a field of `owner`, for any
+   object that might have survived a collection since it was allocated.
+
+   Two collector modes need to hear about pointers from marked objects
+   to unmarked ones:
+   - in generational mode, a young collection only traces from the roots
+     and from the remembered set, so it has to know about every old
+     object that may point at a young one;
+   - while an incremental collection is marking, an object that has
+     already been traced must not end up as the only path to one that
+     hasn't, so the new target gets marked.
+   The slow path checks the mark bits, which are in the heap's side
+   bitmaps (see heap.h). */
+static inline void writeBarrier(Obj* owner, Value value) {
+  if (gcBarrierActive && !owner->isRemembered && IS_OBJ(value)) {
+    writeBarrierSlow(owner, AS_OBJ(value));
+  }
+}
 
 
 /* Helper functions for objects. Again, these take a Value as input */
 
 void printObject(Value value);
 bool objectEqual(Value value0, Value value1);
+// Both of these take any string, flat or not. Either one may allocate,
+// so the caller has to keep its inputs reachable.
 Value concatenateStrings(Value left, Value right);
+ObjString* flattenString(Value value);
 
 ObjFunction* newFunction();
 ObjUpvalue* newUpvalue(Value* value);
@@ -127,7 +196,74 @@ ObjClosure* newClosure(ObjFunction* function);
 /* Helper function for the VM to garbage collect objects.
 
    Note that this does *not* take a Value, because it is a heap-only
-   action and only the Obj part of an object value is on the heap */
+   action and only the Obj part of an object value is on the heap.
+
+   This only frees what the object owns; the object's own memory
+   belongs to heap.c, which is the one that calls this. */
 void freeObject(Obj* object);
 
+// Whether freeObject has anything to do for this object. Only the main
+// thread can free what an object owns, so the background sweeper (see
+// heap.c) leaves these objects to it.
+static inline bool objectOwnsMemory(Obj* object) {
+  return object->type == OBJ_FUNCTION;
+}
+
+// The number of bytes the object was allocated with.
+size_t objectSize(Obj* object);
+
+
+// Call visit(context, reference) for each object that `object` points
+// to. This is the one place that knows what each type of object refers
+// to, for both traceObjectReferences() and the parallel marker; it's
+// inline so that `visit` gets inlined into each of them.
+static inline void forEachReference(Obj* object,
+				    void (*visit)(void* context, Obj* reference),
+				    void* context) {
+#define VISIT(reference) \
+  do { if ((reference) != NULL) visit(context, (Obj*)(reference)); } while (false)
+#define VISIT_VALUE(value) \
+  do { if (IS_OBJ(value)) visit(context, AS_OBJ(value)); } while (false)
+  switch (object->type) {
+  case OBJ_STRING:
+    // Strings don't contain references to other objects; they do
+    // contain data but it's all in the intern table which is
+    // special-cased.
+    break;
+  case OBJ_ROPE: {
+    // The children are NULL once the rope is flattened.
+    ObjRope* rope = (ObjRope*)object;
+    VISIT(rope->left);
+    VISIT(rope->right);
+    VISIT(rope->flat);
+    break;
+  }
+  case OBJ_UPVALUE:
+    VISIT_VALUE(((ObjUpvalue*)object)->closed);  // (this is just NIL if open)
+    break;
+  case OBJ_FUNCTION: {
+    // Functions contain:
+    // - a string for their name
+    // - an array of constants (this is most of the compiler-generated data)
+    ObjFunction* function = (ObjFunction*)object;
+    VISIT(function->name);
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+      VISIT_VALUE(constants->values[i]);
+    }
+    break;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure* closure = (ObjClosure*)object;
+    VISIT(closure->function);
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      VISIT_VALUE(closure->upvalues[i]);
+    }
+    break;
+  }
+  }
+#undef VISIT
+#undef VISIT_VALUE
+}
+
 #endif
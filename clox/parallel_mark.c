@@ -0,0 +1,388 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "heap.h"
+#include "memory.h"
+#include "object.h"
+
+#include "parallel_mark.h"
+
+
+/* Parallel marking with work stealing.
+
+   With --gc-threads=N, a full collection still marks the roots on the
+   main thread (they're spread over the vm, the compiler and the tables,
+   and marking them is quick), and then N threads trace the rest of the
+   graph: the main thread plus N - 1 helpers that sleep in between
+   collections. Incremental slices and young collections are small, so
+   they keep marking on the main thread.
+
+   Each thread traces depth-first from a private stack of gray objects,
+   with no synchronization at all. It also has a deque that the others
+   can steal from: whenever that deque is empty and the private stack has
+   a few objects to spare, it moves the oldest ones over (in a tree,
+   those are the roots of the biggest subtrees). Once the private stack
+   runs dry, the thread takes from the bottom of its own deque, and then
+   steals from the top of somebody else's. The deque is the Chase-Lev
+   one, in the version for weak memory models from "Correct and Efficient
+   Work-Stealing for Weak Memory Models" (Lê et al., 2013). A deque only
+   ever grows, and only its owner grows it; the old arrays stay around
+   until the end of the collection, because a thief may still be reading
+   one. Popping from a deque needs a full fence, which is why there's a
+   private stack in front of it: with every object going through the
+   deque, one marking thread was over twice as slow as the plain
+   markstack.
+
+   Two threads can reach the same object at once, so they set its mark
+   bit with an atomic or (see heapMarkAtomic), and whichever one set the
+   bit traces the object.
+
+   Marking is done when every thread is idle: its private stack and its
+   deque are empty and it couldn't steal anything. An idle thread that sees work in some deque
+   stops being idle before it tries to steal it, and nothing gets pushed
+   except by a thread that isn't idle, so once the idle count reaches N
+   nothing is left.
+
+   Like the markstack, the stacks and deques use plain malloc.
+*/
+
+
+typedef struct {
+  int64_t capacity;  // a power of two
+  Obj* objects[];
+} DequeArray;
+
+
+typedef struct {
+  // Thieves take from the top, the owner pushes and pops at the bottom;
+  // each is only ever incremented by the side it belongs to, except that
+  // the owner and a thief race for the last object through `top`.
+  int64_t top;
+  int64_t bottom;
+  DequeArray* array;
+  // Arrays we grew out of, to free after the collection.
+  DequeArray** retired;
+  int retiredCount;
+  int retiredCapacity;
+} Deque;
+
+
+typedef struct {
+  Obj** stack;
+  int stackCount;
+  int stackCapacity;
+  Deque deque;
+  size_t markedBytes;
+  size_t stolen;
+  unsigned seed;  // for picking victims
+  pthread_t thread;
+  // Keep each thread's deque indices out of the others' cache lines.
+  char padding[64];
+} MarkThread;
+
+
+#define DEQUE_INITIAL_CAPACITY 1024
+
+// A thread hands this many objects at a time over to its deque, once
+// its private stack has twice that many.
+#define SHARE_BATCH 16
+
+
+int markThreadCount = 1;
+size_t markObjectsStolen = 0;
+
+static MarkThread markThreads[MARK_THREADS_MAX];
+
+// How many threads are out of work; see above.
+static int idleThreads = 0;
+
+// The helpers wait for markGeneration to change, and report back by
+// incrementing finishedHelpers.
+static pthread_mutex_t markLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markStart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t markDone = PTHREAD_COND_INITIALIZER;
+static unsigned markGeneration = 0;
+static int finishedHelpers = 0;
+
+
+static void outOfMemory() {
+  fprintf(stderr, "clox: out of memory inside the parallel marker, exiting now %s:%d", __FILE__, __LINE__);
+  exit(1);
+}
+
+
+static DequeArray* newDequeArray(int64_t capacity) {
+  DequeArray* array =
+    (DequeArray*)malloc(sizeof(DequeArray) + sizeof(Obj*) * capacity);
+  if (array == NULL) {
+    outOfMemory();
+  }
+  array->capacity = capacity;
+  return array;
+}
+
+
+static inline Obj* dequeRead(DequeArray* array, int64_t index) {
+  return __atomic_load_n(&array->objects[index & (array->capacity - 1)],
+			 __ATOMIC_RELAXED);
+}
+
+
+static inline void dequeWrite(DequeArray* array, int64_t index, Obj* object) {
+  __atomic_store_n(&array->objects[index & (array->capacity - 1)], object,
+		   __ATOMIC_RELAXED);
+}
+
+
+static DequeArray* growDeque(Deque* deque, DequeArray* array,
+			     int64_t top, int64_t bottom) {
+  DequeArray* grown = newDequeArray(array->capacity * 2);
+  for (int64_t i = top; i < bottom; i++) {
+    dequeWrite(grown, i, dequeRead(array, i));
+  }
+  if (deque->retiredCapacity < deque->retiredCount + 1) {
+    deque->retiredCapacity = GROW_CAPACITY(deque->retiredCapacity);
+    deque->retired = (DequeArray**)realloc(deque->retired,
+					   sizeof(DequeArray*) * deque->retiredCapacity);
+    if (deque->retired == NULL) {
+      outOfMemory();
+    }
+  }
+  deque->retired[deque->retiredCount++] = array;
+  __atomic_store_n(&deque->array, grown, __ATOMIC_RELEASE);
+  return grown;
+}
+
+
+// Owner only.
+static void dequePush(Deque* deque, Obj* object) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  DequeArray* array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+  if (bottom - top > array->capacity - 1) {
+    array = growDeque(deque, array, top, bottom);
+  }
+  dequeWrite(array, bottom, object);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+
+// Owner only. Returns NULL if the deque is empty.
+static Obj* dequeTake(Deque* deque) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  DequeArray* array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+  if (top > bottom) {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  Obj* object = dequeRead(array, bottom);
+  if (top == bottom) {
+    // The last one: a thief may be after it too.
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+				     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      object = NULL;
+    }
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return object;
+}
+
+
+// Any thread. Returns NULL if the deque is empty or another thread got
+// there first.
+static Obj* dequeSteal(Deque* deque) {
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom) {
+    return NULL;
+  }
+  DequeArray* array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+  Obj* object = dequeRead(array, top);
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+				   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  return object;
+}
+
+
+static bool dequeLooksEmpty(Deque* deque) {
+  return __atomic_load_n(&deque->top, __ATOMIC_RELAXED) >=
+    __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+}
+
+
+static void markReference(void* context, Obj* reference) {
+  MarkThread* self = (MarkThread*)context;
+  if (!heapMarkAtomic(reference, &self->markedBytes)) {
+    return;
+  }
+  if (self->stackCapacity < self->stackCount + 1) {
+    self->stackCapacity = GROW_CAPACITY(self->stackCapacity);
+    self->stack = (Obj**)realloc(self->stack,
+				 sizeof(Obj*) * self->stackCapacity);
+    if (self->stack == NULL) {
+      outOfMemory();
+    }
+  }
+  self->stack[self->stackCount++] = reference;
+}
+
+
+// Move the oldest objects on the private stack over to the deque, if
+// the deque has run out and we have some to spare.
+static void shareWork(MarkThread* self) {
+  if (self->stackCount < 2 * SHARE_BATCH || !dequeLooksEmpty(&self->deque)) {
+    return;
+  }
+  for (int i = 0; i < SHARE_BATCH; i++) {
+    dequePush(&self->deque, self->stack[i]);
+  }
+  self->stackCount -= SHARE_BATCH;
+  memmove(self->stack, self->stack + SHARE_BATCH,
+	  sizeof(Obj*) * self->stackCount);
+}
+
+
+// Go round the other threads once, starting at a random one.
+static Obj* stealFromOthers(MarkThread* self) {
+  int start = rand_r(&self->seed) % markThreadCount;
+  for (int i = 0; i < markThreadCount; i++) {
+    MarkThread* victim = &markThreads[(start + i) % markThreadCount];
+    if (victim == self) {
+      continue;
+    }
+    Obj* object = dequeSteal(&victim->deque);
+    if (object != NULL) {
+      self->stolen++;
+      return object;
+    }
+  }
+  return NULL;
+}
+
+
+static bool anyWorkLeft() {
+  for (int i = 0; i < markThreadCount; i++) {
+    if (!dequeLooksEmpty(&markThreads[i].deque)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+static void traceUntilDone(MarkThread* self) {
+  for (;;) {
+    while (self->stackCount > 0) {
+      forEachReference(self->stack[--self->stackCount], markReference, self);
+      shareWork(self);
+    }
+    Obj* object = dequeTake(&self->deque);
+    if (object == NULL) {
+      object = stealFromOthers(self);
+    }
+    if (object != NULL) {
+      forEachReference(object, markReference, self);
+      continue;
+    }
+    __atomic_fetch_add(&idleThreads, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+      if (__atomic_load_n(&idleThreads, __ATOMIC_SEQ_CST) == markThreadCount) {
+	return;
+      }
+      if (anyWorkLeft()) {
+	__atomic_fetch_sub(&idleThreads, 1, __ATOMIC_SEQ_CST);
+	break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+
+static void* helperMain(void* argument) {
+  MarkThread* self = (MarkThread*)argument;
+  unsigned generation = 0;
+  for (;;) {
+    pthread_mutex_lock(&markLock);
+    while (markGeneration == generation) {
+      pthread_cond_wait(&markStart, &markLock);
+    }
+    generation = markGeneration;
+    pthread_mutex_unlock(&markLock);
+
+    traceUntilDone(self);
+
+    pthread_mutex_lock(&markLock);
+    finishedHelpers++;
+    pthread_cond_signal(&markDone);
+    pthread_mutex_unlock(&markLock);
+  }
+  return NULL;
+}
+
+
+void initParallelMark(int thread_count) {
+  markThreadCount = thread_count;
+  if (thread_count == 1) {
+    return;
+  }
+  for (int i = 0; i < thread_count; i++) {
+    MarkThread* thread = &markThreads[i];
+    thread->deque.array = newDequeArray(DEQUE_INITIAL_CAPACITY);
+    thread->seed = i + 1;
+  }
+  // The helpers never exit; they go when the process does.
+  for (int i = 1; i < thread_count; i++) {
+    if (pthread_create(&markThreads[i].thread, NULL, helperMain,
+		       &markThreads[i]) != 0) {
+      fprintf(stderr, "clox: couldn't start marking thread %d, exiting now %s:%d", i, __FILE__, __LINE__);
+      exit(1);
+    }
+  }
+}
+
+
+void parallelTrace(Obj** objects, int count) {
+  // Deal the gray objects out round-robin. Nothing else is running yet,
+  // so pushing onto the helpers' deques from here is safe.
+  for (int i = 0; i < count; i++) {
+    dequePush(&markThreads[i % markThreadCount].deque, objects[i]);
+  }
+  idleThreads = 0;
+  finishedHelpers = 0;
+  pthread_mutex_lock(&markLock);
+  markGeneration++;
+  pthread_cond_broadcast(&markStart);
+  pthread_mutex_unlock(&markLock);
+
+  traceUntilDone(&markThreads[0]);
+
+  pthread_mutex_lock(&markLock);
+  while (finishedHelpers < markThreadCount - 1) {
+    pthread_cond_wait(&markDone, &markLock);
+  }
+  pthread_mutex_unlock(&markLock);
+
+  for (int i = 0; i < markThreadCount; i++) {
+    MarkThread* thread = &markThreads[i];
+    heapMarkedBytes += thread->markedBytes;
+    markObjectsStolen += thread->stolen;
+    thread->markedBytes = 0;
+    thread->stolen = 0;
+    for (int j = 0; j < thread->deque.retiredCount; j++) {
+      free(thread->deque.retired[j]);
+    }
+    thread->deque.retiredCount = 0;
+  }
+}
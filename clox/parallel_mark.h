@@ -0,0 +1,30 @@
+#ifndef clox_parallel_mark_h
+#define clox_parallel_mark_h
+
+#include "common.h"
+#include "object.h"
+
+
+// The most marking threads --gc-threads accepts.
+#define MARK_THREADS_MAX 64
+
+
+// Start the helper threads for marking with `thread_count` threads in
+// all (the calling thread is one of them). With a count of 1 this does
+// nothing, and the collector marks on its own as before.
+void initParallelMark(int thread_count);
+
+// How many threads mark, counting the main one.
+extern int markThreadCount;
+
+// Trace everything reachable from the `count` gray objects, which must
+// already be marked, using all the marking threads. Returns when the
+// whole graph is marked, with the total size of the objects it marked
+// added to heapMarkedBytes.
+void parallelTrace(Obj** objects, int count);
+
+// Objects the marking threads took from each other's deques, for
+// --stats.
+extern size_t markObjectsStolen;
+
+#endif
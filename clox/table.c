@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "heap.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
@@ -8,40 +9,66 @@
 #include "table.h"
 
 
+// With SWISS_TABLES, table_swiss.c implements this API instead.
+#ifndef SWISS_TABLES
+
+
 #define TABLE_MAX_LOAD 0.75
 
 
-/* This is very similar to FindEntry, except that:
+/* Tables use open addressing with Robin Hood probing.
+
+   Capacities are always powers of two, so a hash maps to its home slot
+   with a mask rather than a division. A key's "probe distance" is how far
+   past its home slot it ended up. Insertion keeps the entries in every
+   run of full slots ordered by home slot: when the key being inserted is
+   further from home than the key in the slot it's looking at, it takes
+   that slot and we carry on inserting the evicted key instead.
+
+   That invariant gives us two things:
+   - a lookup can stop as soon as it sees an entry that is closer to home
+     than the key would be at that point, since the key would have
+     evicted it. So misses are about as cheap as hits.
+   - deletion doesn't need tombstones. We shift the rest of the run back
+     by one slot instead ("backward shift deletion"), which leaves the
+     table exactly as if the deleted key had never been inserted.
+
+   Empty entries have a NULL key (and a nil value).
+*/
+
+
+// How far the key in the entry at `index` is from its home slot.
+static inline uint32_t probeDistance(ObjString* key, uint32_t index,
+				     uint32_t mask) {
+  return (index - key->hash) & mask;
+}
+
+
+/* This is very similar to findEntry, except that:
    - it only deals with keys, not values (we're using our table as a
      hashset here).
    - it takes the components of an ObjString as input rather than
      an actual ObjString because it runs *before* we create the struct
-
-   It could in theory get away with skipping tombstones if we used
-   append-only interning, but the clox implementation does garbage-collect
-   unused strings so we need to support tombstones.
 */
 ObjString* tableFindString(Table* strings, const char*
 			   chars, int length, uint32_t hash) {
   if (strings->count == 0) {
     return NULL;
   }
-  uint32_t index = hash % strings->capacity;
-  for (;;) {
+  uint32_t mask = strings->capacity - 1;
+  uint32_t index = hash & mask;
+  for (uint32_t distance = 0;; distance++) {
     Entry* entry = &strings->entries[index];
-    if (entry->key == NULL) {
-      // Skip over tombstones. The first actual empty entry we find indicates
-      // that this is a new string.
-      if (IS_NIL(entry->value)) {
-	return NULL;
-      } else {
-	; // skip over tombstones
-      }
-    } else if (entry->key->length == length &&
-	       memcmp(entry->key->chars, chars, length) == 0) {
+    if (entry->key == NULL ||
+	probeDistance(entry->key, index, mask) < distance) {
+      return NULL;
+    }
+    if (entry->key->hash == hash &&
+	entry->key->length == length &&
+	memcmp(entry->key->chars, chars, length) == 0) {
       return entry->key;
     }
-    index = (index + 1) % strings->capacity;
+    index = (index + 1) & mask;
   }
 }
 
@@ -69,11 +96,35 @@ void markTable(Table* table) {
 }
 
 
+// Remove the entry at `index` by shifting the entries after it, up to the
+// next empty slot or the next entry that is already in its home slot,
+// back by one.
+static void removeEntry(Table* table, uint32_t index) {
+  uint32_t mask = table->capacity - 1;
+  for (;;) {
+    uint32_t next = (index + 1) & mask;
+    Entry* entry = &table->entries[next];
+    if (entry->key == NULL || probeDistance(entry->key, next, mask) == 0) {
+      break;
+    }
+    table->entries[index] = *entry;
+    index = next;
+  }
+  table->entries[index].key = NULL;
+  table->entries[index].value = NIL_VAL;
+  table->count--;
+}
+
+
 void tableDeleteUnmarkedKeys(Table* table) {
-  for (int i = 0; i < table->capacity; i++) {
+  int i = 0;
+  while (i < table->capacity) {
     Entry* entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.isMarked) {
-      tableDelete(table, entry->key);
+    if (entry->key != NULL && !heapIsMarked((Obj*)entry->key)) {
+      // Removing shifts the next entry into this slot, so look at it again.
+      removeEntry(table, i);
+    } else {
+      i++;
     }
   }
 }
@@ -88,31 +139,58 @@ void tableDeleteUnmarkedKeys(Table* table) {
    Note that the key == key check only works because we intern the keys in
    object.h / object.c.
 */
-Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-  uint32_t index = key->hash % capacity;
-  Entry* tombstone = NULL;
-  for (;;) {
+static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
+  uint32_t mask = capacity - 1;
+  uint32_t index = key->hash & mask;
+  for (uint32_t distance = 0;; distance++) {
     Entry* entry = &entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-	// If we find an emtpy entry, the key is not present. Return the
-	// first tombstone we found if any, otherwise that empty entry.
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-	// set the tombstone the first time we find a deleted entry
-	if (tombstone == NULL) {
-	  tombstone = entry;
-	}
-      }
-    } else if (entry->key == key) {
+    if (entry->key == key) {
       return entry;
     }
-    index = (index + 1) % capacity;  // linear scan with wraparound on collisions
+    if (entry->key == NULL ||
+	probeDistance(entry->key, index, mask) < distance) {
+      return NULL;
+    }
+    index = (index + 1) & mask;
+  }
+}
+
+
+// Insert or overwrite, returning whether the key is new. The caller has
+// to make sure there's room.
+static bool insertEntry(Entry* entries, int capacity, ObjString* key,
+			Value value) {
+  uint32_t mask = capacity - 1;
+  uint32_t index = key->hash & mask;
+  for (uint32_t distance = 0;; distance++) {
+    Entry* entry = &entries[index];
+    if (entry->key == NULL) {
+      entry->key = key;
+      entry->value = value;
+      return true;
+    }
+    if (entry->key == key) {
+      entry->value = value;
+      return false;
+    }
+    uint32_t existing = probeDistance(entry->key, index, mask);
+    if (existing < distance) {
+      // Take the slot from the entry that is closer to home, and go on to
+      // insert that one instead. It can't be anywhere else in the table,
+      // so from here on we're just looking for an empty slot.
+      Entry evicted = *entry;
+      entry->key = key;
+      entry->value = value;
+      key = evicted.key;
+      value = evicted.value;
+      distance = existing;
+    }
+    index = (index + 1) & mask;
   }
 }
 
 
-void adjustCapacity(Table* table, int capacity) {
+static void adjustCapacity(Table* table, int capacity) {
   // create a new array (contents will be undefined!)
   Entry* entries = ALLOCATE(Entry, capacity);
   // initialize the array with empty entries - this ensures no undefined behavior
@@ -121,16 +199,10 @@ void adjustCapacity(Table* table, int capacity) {
     entries[i].value = NIL_VAL;
   }
   // Copy over data.
-  //
-  // Note that we skip tombstones, and so we want to reset the count.
-  table->count = 0;
   for (int i = 0; i < table->capacity; i++) {
     Entry* source = &table->entries[i];
     if ((source->key) != NULL) {
-      Entry* dest = findEntry(entries, capacity, source->key);
-      dest->key = source->key;
-      dest->value = source->value;
-      table->count++;
+      insertEntry(entries, capacity, source->key, source->value);
     }
   }
   // free the old entries' memory
@@ -142,22 +214,16 @@ void adjustCapacity(Table* table, int capacity) {
 
 
 bool tableSet(Table* table, ObjString* key, Value value) {
-  // resize if necessary
+  // resize if necessary (GROW_CAPACITY starts at 8 and doubles, so the
+  // capacity stays a power of two)
   if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
     int capacity = GROW_CAPACITY(table->capacity);
     adjustCapacity(table, capacity);
   }
-  // Find the right entry. Note that it may be an empty entry, but
-  // we'll always get something because the entries are pre-populated.
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  // increment the count, but only if we didn't re-occupy a tombstone
-  if (isNewKey && IS_NIL(entry->value)) {
+  bool isNewKey = insertEntry(table->entries, table->capacity, key, value);
+  if (isNewKey) {
     table->count++;
   }
-  // Set the entry value.
-  entry->key = key;
-  entry->value = value;
   return isNewKey;
 }
 
@@ -167,7 +233,7 @@ bool tableGet(Table* table, ObjString* key, Value* valueInOut) {
     return false;
   }
   Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) {
+  if (entry == NULL) {
     return false;
   }
   *valueInOut = entry->value;
@@ -180,20 +246,11 @@ bool tableDelete(Table* table, ObjString* key) {
     return false;
   }
   Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) {
+  if (entry == NULL) {
     return false;
   }
-  // Tombstone the entry.
-  //
-  // Note that `findEntries` depends on these tombstones, which are
-  // distinct (boolean true vs nil) from initial, empty entries.
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  removeEntry(table, (uint32_t)(entry - table->entries));
   return true;
-  // Note that we never decreased the count. This is intentional:
-  // tombstones aren't really empty from the standpoint of findEntries
-  // termination, so we treat them as if they were full from a counting
-  // perspective.
 }
 
 
@@ -205,3 +262,5 @@ void tableAddAll(Table* from, Table* to) {
     }
   }
 }
+
+#endif
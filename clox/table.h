@@ -5,18 +5,48 @@
 #include "value.h"
 
 
+#ifdef SWISS_TABLES
+
+// A SwissTable-style hash table (see table_swiss.c). Each slot has a
+// control byte recording whether it's empty, deleted, or full and if so
+// 7 bits of the key's hash. The control bytes are probed 16 at a time,
+// and keys and values live in parallel arrays that a probe only touches
+// on a hash match.
+typedef struct {
+  int count;       // keys
+  int capacity;    // 0 or a power of two, at least TABLE_GROUP_SIZE
+  int tombstones;  // deleted slots, which still count toward the load
+  uint8_t* control;
+  ObjString** keys;
+  Value* values;
+} Table;
+
+#define TABLE_GROUP_SIZE 16
+
+// The bytes each slot takes, for comparing configurations.
+#define TABLE_SLOT_SIZE (1 + sizeof(ObjString*) + sizeof(Value))
+
+#else
+
 typedef struct {
   ObjString* key;
   Value value;
 } Entry;
 
 
+// A hash table keyed by interned strings; see table.c for how it probes.
+// The capacity is always 0 or a power of two, and there are no
+// tombstones, so `count` is exactly the number of keys.
 typedef struct {
   int count;
   int capacity;
   Entry* entries;
 } Table;
 
+#define TABLE_SLOT_SIZE sizeof(Entry)
+
+#endif
+
 
 ObjString* tableFindString(Table* table, const char* chars, int
 			   length, uint32_t hash);
@@ -0,0 +1,308 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+
+#include "table.h"
+
+
+// Without SWISS_TABLES, table.c implements this API instead.
+#ifdef SWISS_TABLES
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+/* A SwissTable-style layout: instead of an array of key / value pairs,
+   a table has three parallel arrays, and the interesting one is the
+   array of control bytes, one per slot:
+   - CONTROL_EMPTY (0x80) for a slot that has never been used
+   - CONTROL_DELETED (0xfe) for a tombstone
+   - otherwise, 0 to 127: the slot is full, and this is the low 7 bits of
+     its key's hash (H2 below)
+
+   The slots are split into aligned groups of TABLE_GROUP_SIZE (16). The
+   rest of the hash (H1) picks the group where a key's probe starts; from
+   there we visit groups in triangular order (+1, +2, +3, ...), which
+   reaches every group when the group count is a power of two.
+
+   Within a group, one SSE2 compare finds every slot whose control byte
+   equals the key's H2, and we only look at the keys (and never at the
+   values) for those. With 7 bits of hash that's almost always just the
+   one slot we're looking for. A lookup stops at the first group that has
+   an empty slot, since an insert would have put the key there.
+
+   The probe stops at any empty slot in a group, so deletion can only
+   free a slot (rather than leave a tombstone) when its group already has
+   an empty slot: then no probe has ever gone past this group. Tombstones
+   count toward the load, and a resize drops them all.
+*/
+
+
+#define CONTROL_EMPTY ((uint8_t)0x80)
+#define CONTROL_DELETED ((uint8_t)0xfe)
+
+// Full slots have their top bit clear.
+#define IS_FULL(control) ((control) < 0x80)
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)((hash) & 0x7f))
+
+// Grow (or just clean out tombstones) once 7/8 of the slots are in use.
+#define TABLE_MAX_LOAD_NUMERATOR 7
+#define TABLE_MAX_LOAD_DENOMINATOR 8
+
+
+// A bitmask with bit i set if control byte i of the group equals `byte`.
+static inline uint32_t groupMatch(const uint8_t* group, uint8_t byte) {
+#ifdef __SSE2__
+  __m128i control = _mm_loadu_si128((const __m128i*)group);
+  __m128i match = _mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte));
+  return (uint32_t)_mm_movemask_epi8(match);
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+    mask |= (uint32_t)(group[i] == byte) << i;
+  }
+  return mask;
+#endif
+}
+
+
+// A bitmask of the empty or deleted slots in a group, which are exactly
+// the ones with the top bit set.
+static inline uint32_t groupMatchFree(const uint8_t* group) {
+#ifdef __SSE2__
+  __m128i control = _mm_loadu_si128((const __m128i*)group);
+  return (uint32_t)_mm_movemask_epi8(control);
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+    mask |= (uint32_t)(!IS_FULL(group[i])) << i;
+  }
+  return mask;
+#endif
+}
+
+
+// Index of the lowest set bit of a (non-zero) match mask.
+#define FIRST_MATCH(mask) __builtin_ctz(mask)
+
+
+ObjString* tableFindString(Table* strings, const char*
+			   chars, int length, uint32_t hash) {
+  if (strings->count == 0) {
+    return NULL;
+  }
+  uint32_t group_mask = strings->capacity / TABLE_GROUP_SIZE - 1;
+  uint32_t group = H1(hash) & group_mask;
+  for (uint32_t step = 1;; step++) {
+    uint32_t start = group * TABLE_GROUP_SIZE;
+    const uint8_t* control = &strings->control[start];
+    for (uint32_t match = groupMatch(control, H2(hash));
+	 match != 0; match &= match - 1) {
+      ObjString* key = strings->keys[start + FIRST_MATCH(match)];
+      if (key->hash == hash && key->length == length &&
+	  memcmp(key->chars, chars, length) == 0) {
+	return key;
+      }
+    }
+    if (groupMatch(control, CONTROL_EMPTY) != 0) {
+      return NULL;
+    }
+    group = (group + step) & group_mask;
+  }
+}
+
+
+void initTable(Table* table) {
+  table->count = 0;
+  table->capacity = 0;
+  table->tombstones = 0;
+  table->control = NULL;
+  table->keys = NULL;
+  table->values = NULL;
+}
+
+
+void freeTable(Table* table) {
+  FREE_ARRAY(uint8_t, table->control, table->capacity);
+  FREE_ARRAY(ObjString*, table->keys, table->capacity);
+  FREE_ARRAY(Value, table->values, table->capacity);
+  initTable(table);
+}
+
+
+void markTable(Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    if (IS_FULL(table->control[i])) {
+      markObject((Obj*)table->keys[i]);
+      markValue(table->values[i]);
+    }
+  }
+}
+
+
+static void removeSlot(Table* table, int slot) {
+  uint8_t* group = &table->control[slot & ~(TABLE_GROUP_SIZE - 1)];
+  if (groupMatch(group, CONTROL_EMPTY) != 0) {
+    table->control[slot] = CONTROL_EMPTY;
+  } else {
+    table->control[slot] = CONTROL_DELETED;
+    table->tombstones++;
+  }
+  table->keys[slot] = NULL;
+  table->values[slot] = NIL_VAL;
+  table->count--;
+}
+
+
+void tableDeleteUnmarkedKeys(Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    if (IS_FULL(table->control[i]) && !heapIsMarked((Obj*)table->keys[i])) {
+      removeSlot(table, i);
+    }
+  }
+}
+
+
+// The slot holding `key`, or -1. Like the other table, this relies on
+// keys being interned, so that comparing pointers is enough.
+static int findSlot(Table* table, ObjString* key) {
+  uint32_t group_mask = table->capacity / TABLE_GROUP_SIZE - 1;
+  uint32_t group = H1(key->hash) & group_mask;
+  for (uint32_t step = 1;; step++) {
+    uint32_t start = group * TABLE_GROUP_SIZE;
+    const uint8_t* control = &table->control[start];
+    for (uint32_t match = groupMatch(control, H2(key->hash));
+	 match != 0; match &= match - 1) {
+      int slot = start + FIRST_MATCH(match);
+      if (table->keys[slot] == key) {
+	return slot;
+      }
+    }
+    if (groupMatch(control, CONTROL_EMPTY) != 0) {
+      return -1;
+    }
+    group = (group + step) & group_mask;
+  }
+}
+
+
+// The first empty or deleted slot on the probe sequence for `hash`.
+static int findFreeSlot(uint8_t* control, int capacity, uint32_t hash) {
+  uint32_t group_mask = capacity / TABLE_GROUP_SIZE - 1;
+  uint32_t group = H1(hash) & group_mask;
+  for (uint32_t step = 1;; step++) {
+    uint32_t start = group * TABLE_GROUP_SIZE;
+    uint32_t match = groupMatchFree(&control[start]);
+    if (match != 0) {
+      return start + FIRST_MATCH(match);
+    }
+    group = (group + step) & group_mask;
+  }
+}
+
+
+static void adjustCapacity(Table* table, int capacity) {
+  uint8_t* control = ALLOCATE(uint8_t, capacity);
+  ObjString** keys = ALLOCATE(ObjString*, capacity);
+  Value* values = ALLOCATE(Value, capacity);
+  memset(control, CONTROL_EMPTY, capacity);
+  for (int i = 0; i < capacity; i++) {
+    keys[i] = NULL;
+    values[i] = NIL_VAL;
+  }
+  // Copy over data; the tombstones stay behind.
+  for (int i = 0; i < table->capacity; i++) {
+    if (IS_FULL(table->control[i])) {
+      ObjString* key = table->keys[i];
+      int slot = findFreeSlot(control, capacity, key->hash);
+      control[slot] = H2(key->hash);
+      keys[slot] = key;
+      values[slot] = table->values[i];
+    }
+  }
+  FREE_ARRAY(uint8_t, table->control, table->capacity);
+  FREE_ARRAY(ObjString*, table->keys, table->capacity);
+  FREE_ARRAY(Value, table->values, table->capacity);
+  table->control = control;
+  table->keys = keys;
+  table->values = values;
+  table->capacity = capacity;
+  table->tombstones = 0;
+}
+
+
+bool tableSet(Table* table, ObjString* key, Value value) {
+  if (table->count > 0) {
+    int slot = findSlot(table, key);
+    if (slot >= 0) {
+      table->values[slot] = value;
+      return false;
+    }
+  }
+  int used = table->count + table->tombstones + 1;
+  if (used * TABLE_MAX_LOAD_DENOMINATOR >
+      table->capacity * TABLE_MAX_LOAD_NUMERATOR) {
+    // If it's mostly tombstones, rehashing at the same size is enough.
+    int capacity = table->capacity;
+    if (capacity == 0) {
+      capacity = TABLE_GROUP_SIZE;
+    } else if ((table->count + 1) * 2 * TABLE_MAX_LOAD_DENOMINATOR >
+	       capacity * TABLE_MAX_LOAD_NUMERATOR) {
+      capacity = GROW_CAPACITY(capacity);
+    }
+    adjustCapacity(table, capacity);
+  }
+  int slot = findFreeSlot(table->control, table->capacity, key->hash);
+  if (table->control[slot] == CONTROL_DELETED) {
+    table->tombstones--;
+  }
+  table->control[slot] = H2(key->hash);
+  table->keys[slot] = key;
+  table->values[slot] = value;
+  table->count++;
+  return true;
+}
+
+
+bool tableGet(Table* table, ObjString* key, Value* valueInOut) {
+  if (table->count == 0) {
+    return false;
+  }
+  int slot = findSlot(table, key);
+  if (slot < 0) {
+    return false;
+  }
+  *valueInOut = table->values[slot];
+  return true;
+}
+
+
+bool tableDelete(Table* table, ObjString* key) {
+  if (table->count == 0) {
+    return false;
+  }
+  int slot = findSlot(table, key);
+  if (slot < 0) {
+    return false;
+  }
+  removeSlot(table, slot);
+  return true;
+}
+
+
+void tableAddAll(Table* from, Table* to) {
+  for (int i = 0; i < from->capacity; i++) {
+    if (IS_FULL(from->control[i])) {
+      tableSet(to, from->keys[i], from->values[i]);
+    }
+  }
+}
+
+#endif
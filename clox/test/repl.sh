@@ -0,0 +1,40 @@
+#!/usr/bin/env bash
+
+# Regression test for the REPL: every line is its own script, so each
+# one must leave the value stack as it found it. Feed it more lines than
+# the initial stack has slots (STACK_INITIAL) and check that the last
+# one still runs. Build with -fsanitize=address to catch any overflow.
+#
+# Usage (from the clox directory):
+#   bash test/repl.sh [path to clox, default: build one]
+
+set -e
+
+TEST_DIR=$(cd "$(dirname "$0")" && pwd)
+CLOX_DIR=$(dirname "$TEST_DIR")
+LINES=3000
+
+CLOX=$1
+if [ -z "$CLOX" ]; then
+  BUILD_DIR=$(mktemp -d)
+  trap 'rm -rf "$BUILD_DIR"' EXIT
+  CLOX="$BUILD_DIR/clox"
+  gcc -g -O1 -pthread -o "$CLOX" "$CLOX_DIR"/*.c
+fi
+
+output=$(
+  for i in $(seq 1 $LINES); do echo "var a$i = $i;"; done
+  echo "print a1 + a$LINES;"
+  echo "fun f(n) { if (n < 2) return n; return f(n - 1) + 1; }"
+  echo "print f(2000);"
+)
+result=$(echo "$output" | "$CLOX" | sed 's/lox> //g' | grep -v '^$' || true)
+expected=$'3001\n2000'
+if [ "$result" != "$expected" ]; then
+  echo "FAIL: expected"
+  echo "$expected"
+  echo "got"
+  echo "$result"
+  exit 1
+fi
+echo "ok: $LINES REPL lines"
@@ -25,12 +25,23 @@ void writeValueArray(ValueArray* array, Value value) {
 
 
 void freeValueArray(ValueArray* array) {
-  FREE_ARRAY(Value, array->values, array->count);
+  FREE_ARRAY(Value, array->values, array->capacity);
   initValueArray(array);
 }
 
 
 void printValue(Value value) {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value)) {
+    printf(AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    printf("nil");
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_OBJ(value)) {
+    printObject(value);
+  }
+#else
   switch (value.type) {
   case VAL_BOOL:
     printf(AS_BOOL(value) ? "true" : "false");
@@ -47,6 +58,7 @@ void printValue(Value value) {
     printObject(value);
     break;
   }
+#endif
 }
 
 
@@ -67,6 +79,18 @@ bool valueEqual(Value value0, Value value1) {
   //
   // In addition, memcmp wouldn't work for types that hold pointers,
   // which we will eventually need to handle
+#ifdef NAN_BOXING
+  // With NaN boxing, nil / bools are singletons and so are equal exactly
+  // when their bits are. Numbers still need a floating-point comparison
+  // (so that NaN != NaN), and objects go through objectEqual.
+  if (IS_NUMBER(value0) && IS_NUMBER(value1)) {
+    return AS_NUMBER(value0) == AS_NUMBER(value1);
+  }
+  if (IS_OBJ(value0) && IS_OBJ(value1)) {
+    return objectEqual(value0, value1);
+  }
+  return value0 == value1;
+#else
   if (value0.type != value1.type) {
     return false;
   }
@@ -83,4 +107,5 @@ bool valueEqual(Value value0, Value value1) {
     fprintf(stderr, "Should be unreachable equality comparison!\n");
     return false;
   }
+#endif
 }
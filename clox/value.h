@@ -29,6 +29,75 @@ typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
 
+#ifdef NAN_BOXING
+
+/*
+  NaN-boxed values: a Value is just the 64 bits of a double.
+
+  Any double whose exponent bits are all set and whose top mantissa
+  ("quiet") bit is set is a NaN, and the hardware only ever produces
+  one particular such NaN. That leaves ~51 bits of payload we can use
+  for everything else:
+  - nil / true / false live in the bottom two bits of the quiet NaN.
+  - Obj* pointers (which only use the low 48 bits on the platforms we
+    care about) live in the payload, with the sign bit set to tell
+    them apart from the singletons.
+
+  This halves the size of a Value (8 bytes instead of 16), which also
+  halves vm.stack, constant arrays and table entries, and type checks
+  become a single mask-and-compare on the value itself.
+ */
+
+#include <string.h>
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL   1  // 01
+#define TAG_FALSE 2  // 10
+#define TAG_TRUE  3  // 11
+
+typedef uint64_t Value;
+
+
+#define FALSE_VAL         ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define BOOL_VAL(value)   ((value) ? TRUE_VAL : FALSE_VAL)
+#define NUMBER_VAL(value) numberToValue(value)
+#define OBJ_VAL(value) \
+  (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(value))
+
+// true and false differ only in the lowest bit, so OR-ing in that bit
+// maps both of them (and nothing else) to TRUE_VAL.
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) \
+  (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) valueToNumber(value)
+#define AS_OBJ(value) ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+
+// These go through memcpy rather than a pointer cast or union so that
+// we don't run afoul of strict aliasing; compilers turn them into a
+// plain register move.
+static inline double valueToNumber(Value value) {
+  double number;
+  memcpy(&number, &value, sizeof(Value));
+  return number;
+}
+
+static inline Value numberToValue(double number) {
+  Value value;
+  memcpy(&value, &number, sizeof(double));
+  return value;
+}
+
+#else
+
 typedef enum {
   VAL_BOOL,
   VAL_NIL,
@@ -60,6 +129,8 @@ typedef struct {
 #define AS_NUMBER(value) ((value).data.number)
 #define AS_OBJ(value) ((value).data.object)
 
+#endif
+
 
 typedef struct {
   int capacity;
@@ -1,9 +1,12 @@
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "heap.h"
 #include "object.h"
 #include "memory.h"
 #include "table.h"
@@ -31,50 +34,55 @@ void markVmRoots() {
   }
   // Mark the globals
   GC_LOG("     -- mark vm globals --\n");
-  markTable(&vm.globals);
+  for (int i = 0; i < vm.globalCount; i++) {
+    markObject((Obj*)vm.globals[i].name);
+    markValue(vm.globals[i].value);
+  }
+  markTable(&vm.globalSlots);
   // Mark the open upvalues
   //
   // Why is this needed? Well, we don't actually remove these
   // upvalues until the local goes out of scope, so even if there's
-  // no live reference to the upvalue it will still be sitting in
-  // our linked list. Deallocating it would break the list!
+  // no live reference to the upvalue, `vm.openUpvalues` still has it
+  // at its local's stack slot. Deallocating it would leave that slot
+  // pointing at freed memory.
   //
   // It's also possible that some closure will come along and
-  // actually reuse an upvalue that has no current frame reference.
-  for (ObjUpvalue* upvalue = vm.openUpvalues;
-       upvalue != NULL;
-       upvalue = upvalue->next) {
-    markObject((Obj*)upvalue);
+  // actually reuse an upvalue that has no current frame reference,
+  // since captureUpvalue looks it up by that slot.
+  for (int i = 0; i < vm.stack_top - vm.stack; i++) {
+    if (vm.openUpvalues[i] != NULL) {
+      markObject((Obj*)vm.openUpvalues[i]);
+    }
   }
 }
 
 
+void sweepVmStrings() {
+  tableDeleteUnmarkedKeys(&vm.strings);
+}
+
+
 void sweepVmObjects() {
   // First, delete unused interned strings (otherwise, the table keys
   // would contain danging pointers post-sweep!)
-  tableDeleteUnmarkedKeys(&vm.strings);
+  sweepVmStrings();
   // Now, sweep the heap
-  Obj** previous_pointer = &vm.objects;
-  while (*previous_pointer != NULL) {
-    Obj* object = *previous_pointer;
-    if (object->isMarked) {
-      // bump previous_pointer
-      previous_pointer = &object->next;
-      // unmark the object
-      object->isMarked = false;
-    } else {
-      // redefine previous pointer
-      *previous_pointer = object->next;
-      freeObject(object);
-    }
-  }
+  heapSweep();
 }
 
 
-
-void vmInsertObjectIntoHeap(Obj* object) {
-  object->next = vm.objects;
-  vm.objects = object;
+void sweepVmNursery() {
+  // Same as above, but we only need to look at young strings: the
+  // old ones weren't collected.
+  int count;
+  Obj** young = heapYoungObjects(&count);
+  for (int i = 0; i < count; i++) {
+    if (young[i]->type == OBJ_STRING && !heapIsMarked(young[i])) {
+      tableDelete(&vm.strings, (ObjString*)young[i]);
+    }
+  }
+  heapSweepNursery();
 }
 
 
@@ -86,24 +94,85 @@ bool vmAddInternedString(ObjString* string) {
 ObjString* vmFindInternedString(const char* chars, int length, uint32_t hash) {
   return tableFindString(&vm.strings, chars, length, hash);
 }
+
+
+int vmGlobalSlot(ObjString* name) {
+  Value slot;
+  if (tableGet(&vm.globalSlots, name, &slot)) {
+    return (int)AS_NUMBER(slot);
+  }
+  // Growing either the slots or the table can trigger a GC, and the
+  // caller has probably only just created `name`.
+  push(OBJ_VAL(name));
+  if (vm.globalCapacity < vm.globalCount + 1) {
+    int old_capacity = vm.globalCapacity;
+    vm.globalCapacity = GROW_CAPACITY(old_capacity);
+    vm.globals = GROW_ARRAY(Global, vm.globals, old_capacity, vm.globalCapacity);
+  }
+  int index = vm.globalCount++;
+  Global* global = &vm.globals[index];
+  global->name = name;
+  global->value = NIL_VAL;
+  global->isDefined = false;
+  tableSet(&vm.globalSlots, name, NUMBER_VAL(index));
+  pop();
+  return index;
+}
+
+
+ObjString* vmGlobalName(int slot) {
+  return vm.globals[slot].name;
+}
+
+
+int vmGlobalCount() {
+  return vm.globalCount;
+}
 			 
 
 
 static void resetStack() {
-  // no nead to actually clear the stack, just reset pointer. This
-  // works because the stack is not a pointer but a plain array, inlined
-  // directly in the vm and allocated as part of the struct.
+  // no nead to actually clear the stack, just reset pointer. The open
+  // upvalues are another matter, since a slot's entry has to be NULL
+  // until something captures it.
+  memset(vm.openUpvalues, 0, sizeof(ObjUpvalue*) * (vm.stack_top - vm.stack));
   vm.stack_top = vm.stack;
 }
 
+
+// Like the markstack, the stacks use plain malloc: they're not part of
+// the Lox heap, and growing them must not trigger a GC.
+static void* reallocateStack(void* pointer, size_t size) {
+  void* result = realloc(pointer, size);
+  if (result == NULL) {
+    fprintf(stderr, "clox: out of memory growing the stack, exiting now %s:%d", __FILE__, __LINE__);
+    exit(1);
+  }
+  return result;
+}
+
+
 void initVM() {
-  resetStack();
+  vm.frames = (CallFrame*)reallocateStack(NULL, sizeof(CallFrame) * FRAMES_INITIAL);
+  vm.frameCapacity = FRAMES_INITIAL;
+  vm.stack = (Value*)reallocateStack(NULL, sizeof(Value) * STACK_INITIAL);
+  vm.stack_end = vm.stack + STACK_INITIAL;
+  vm.openUpvalues = (ObjUpvalue**)reallocateStack(NULL, sizeof(ObjUpvalue*) * STACK_INITIAL);
+  memset(vm.openUpvalues, 0, sizeof(ObjUpvalue*) * STACK_INITIAL);
+  vm.stack_top = vm.stack;
   initTable(&vm.strings);
-  initTable(&vm.globals);
+  vm.globals = NULL;
+  vm.globalCount = 0;
+  vm.globalCapacity = 0;
+  initTable(&vm.globalSlots);
+  vm.quickenedSites = 0;
+  vm.deoptimizedSites = 0;
   vm.frameCount = 0;
-  vm.openUpvalues = NULL;
 }
 
+// A stack trace shows this many frames at either end.
+#define TRACE_FRAMES_SHOWN 16
+
 static void runtimeError(const char* format, ...) {
   // Dump the raw message to stderr
   va_list args;
@@ -115,6 +184,13 @@ static void runtimeError(const char* format, ...) {
   // For each call frame (starting with the innermost, which is
   // at index vm.frameCount - 1)...
   for (int frameIndex = vm.frameCount - 1; frameIndex >= 0; frameIndex --) {
+    // ...except that for deep recursion, the middle isn't interesting.
+    if (vm.frameCount > 2 * TRACE_FRAMES_SHOWN &&
+	frameIndex == vm.frameCount - 1 - TRACE_FRAMES_SHOWN) {
+      fprintf(stderr, "[... %d more frames ...]\n",
+	      vm.frameCount - 2 * TRACE_FRAMES_SHOWN);
+      frameIndex = TRACE_FRAMES_SHOWN;
+    }
     // ...Find the relevant line number and dump that as well
     //
     // Why the extra -1? Remember that one invariant is `ip` always
@@ -137,10 +213,11 @@ static void runtimeError(const char* format, ...) {
 }
 
 
-/* Note that the value stack is *statically* sized, so push will never
-   trigger a GC. We rely on this heavily - any time we call into code
-   that could trigger a resize operation, we can temporarily push any
-   values that the GC would otherwise be unaware of.
+/* Note that push never grows the value stack (only calls do, see
+   reserveFrame), so it will never trigger a GC. We rely on this
+   heavily - any time we call into code that could trigger a resize
+   operation, we can temporarily push any values that the GC would
+   otherwise be unaware of.
 */
 void push(Value value) {
   // Note that if we were defensive, we'd be checking for stack
@@ -169,20 +246,88 @@ Value peek(int distance) {
 
 /* Helpers for run() */
 
+
+// Move the value stack somewhere with room for at least `needed` more
+// slots above the top. Everything that points into it moves along: the
+// frames' slots, and the open upvalues. (The run() loop reloads its
+// frame after every call, which is the only place this happens.)
+static void growStack(size_t needed) {
+  Value* old_stack = vm.stack;
+  size_t old_capacity = vm.stack_end - vm.stack;
+  size_t capacity = old_capacity;
+  size_t used = vm.stack_top - vm.stack;
+  while (capacity - used < needed) {
+    capacity *= 2;
+  }
+  vm.openUpvalues = (ObjUpvalue**)reallocateStack(vm.openUpvalues,
+						  sizeof(ObjUpvalue*) * capacity);
+  memset(vm.openUpvalues + old_capacity, 0,
+	 sizeof(ObjUpvalue*) * (capacity - old_capacity));
+  // Not realloc: the old pointers are only meaningful while the old
+  // stack is still there.
+  vm.stack = (Value*)reallocateStack(NULL, sizeof(Value) * capacity);
+  memcpy(vm.stack, old_stack, sizeof(Value) * used);
+  vm.stack_end = vm.stack + capacity;
+  vm.stack_top = vm.stack + used;
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].slots = vm.stack + (vm.frames[i].slots - old_stack);
+  }
+  for (size_t i = 0; i < used; i++) {
+    if (vm.openUpvalues[i] != NULL) {
+      vm.openUpvalues[i]->location = &vm.stack[i];
+    }
+  }
+  free(old_stack);
+}
+
+
+// The slow path of reserveFrame.
+static bool growForFrame(Value* slots, int stack_slots) {
+  if (vm.frameCount == vm.frameCapacity) {
+    if (vm.frameCount >= FRAMES_MAX) {
+      runtimeError("Stack overflow (too many call frames).");
+      return false;
+    }
+    vm.frameCapacity *= 2;
+    vm.frames = (CallFrame*)reallocateStack(vm.frames,
+					    sizeof(CallFrame) * vm.frameCapacity);
+  }
+  if (vm.stack_end - slots < stack_slots) {
+    growStack(stack_slots - (vm.stack_top - slots));
+  }
+  return true;
+}
+
+
+// Make room for one more frame, whose slots start at `slots`, and for
+// it to use `stack_slots` of them. This is the only place either stack
+// grows, so that push() doesn't have to check anything. Returns false
+// (after reporting a runtime error) if we're out of frames.
+static inline bool reserveFrame(Value* slots, int stack_slots) {
+  if (vm.frameCount < vm.frameCapacity &&
+      vm.stack_end - slots >= stack_slots) {
+    return true;
+  }
+  return growForFrame(slots, stack_slots);
+}
+
+
 static bool call(ObjClosure* closure, uint8_t arg_count) {
   // Check that we can grab a call frame, then grab it
-  if ((vm.frameCount >= FRAMES_MAX)) {
-    runtimeError("Stack overflow (too many call frames).");
+  Value* slots = vm.stack_top - arg_count - 1;
+  if (!reserveFrame(slots, closure->function->maxStack + FRAME_STACK_EXTRA)) {
     return false;
   }
   if ((closure->function->arity != arg_count)) {
     runtimeError("Mismatch in argument count.");
     return false;
   }
+  // (reserveFrame may have moved the stack)
   CallFrame* frame = &vm.frames[vm.frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
   frame->slots = vm.stack_top - arg_count - 1;
+  frame->openUpvalueCount = 0;
   return true;
 }
 
@@ -197,48 +342,78 @@ static bool callValue(Value callee, uint8_t arg_count) {
 }
 
 
+
+// Get the upvalue for a local of the current frame, creating it if the
+// local hasn't been captured yet.
 static ObjUpvalue* captureUpvalue(Value* local) {
-  // Search for an upvalue that already exists on this local.
-  //
-  // We can find it by just comparing the value pointer (which is a
-  // stack slot). We keep the list reverse-ordered by stack position
-  // so that searches are generally cheap.
-  ObjUpvalue* upvalue = vm.openUpvalues;
-  ObjUpvalue** insert_pointer = &vm.openUpvalues;
-  while (upvalue != NULL && upvalue->location > local) {
-    insert_pointer = &upvalue->next;
-    upvalue = upvalue->next;
-  }
-  // At this point we either found the upvalue or we are ready to
-  // insert a new one in front of `upvalue`.
-  if (upvalue != NULL && upvalue->location == local) {
-    return upvalue;
-  } else {
+  // Open upvalues are indexed by stack slot, so finding an existing one
+  // is a lookup rather than a search.
+  ObjUpvalue** slot = &vm.openUpvalues[local - vm.stack];
+  if (*slot == NULL) {
     ObjUpvalue* created = newUpvalue(local);
-    *insert_pointer = created;  // (-> binds tighter than *)
-    created->next = upvalue;
-    return created;
+    // (newUpvalue can GC, but can't move the stack, so `slot` is
+    // still good)
+    *slot = created;
+    vm.frames[vm.frameCount - 1].openUpvalueCount++;
   }
+  return *slot;
 }
 
 
 /* Close all open upvalues associated with this local or anything
    deeper in the stack ("deeper in the stack" matters when we end
    a function and reset the frame all at once with no OP_POPs).
-   
-   Note that all of them will live at the list head. */
-static void closeUpvalues(Value* last) {
-  while (vm.openUpvalues != NULL
-	 && vm.openUpvalues->location > last) {
-    ObjUpvalue* upvalue = vm.openUpvalues;
+
+   These are all in `frame`, so we only look at its slots, top down, and
+   stop once it has none left open. */
+static void closeUpvalues(CallFrame* frame, Value* last) {
+  for (Value* local = vm.stack_top - 1;
+       frame->openUpvalueCount > 0 && local >= last;
+       local--) {
+    ObjUpvalue** slot = &vm.openUpvalues[local - vm.stack];
+    ObjUpvalue* upvalue = *slot;
+    if (upvalue == NULL) {
+      continue;
+    }
     // Copy the Value out of the stack and into `closed`, *moving*
     // any associated *Obj pointer (in the rust ownership sense).
     //
     // The VM heap is essentially composed of closed upvalues.
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
-    vm.openUpvalues = vm.openUpvalues->next;
+    writeBarrier((Obj*)upvalue, upvalue->closed);
+    *slot = NULL;
+    frame->openUpvalueCount--;
+  }
+}
+
+
+// callValue for OP_TAIL_CALL: rather than push a frame, we replace the
+// current one. Its upvalues get closed just like on a return, then the
+// callee and arguments slide down to the frame's start, so that a loop
+// written as tail recursion runs in constant stack.
+static bool tailCallValue(Value callee, uint8_t arg_count) {
+  if (!IS_OBJ(callee) || !IS_CLOSURE(callee)) {
+    runtimeError("Can only call functions.");
+    return false;
+  }
+  ObjClosure* closure = AS_CLOSURE(callee);
+  if ((closure->function->arity != arg_count)) {
+    runtimeError("Mismatch in argument count.");
+    return false;
   }
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  closeUpvalues(frame, frame->slots);
+  memmove(frame->slots, vm.stack_top - arg_count - 1,
+	  sizeof(Value) * (arg_count + 1));
+  vm.stack_top = frame->slots + arg_count + 1;
+  int stack_slots = closure->function->maxStack + FRAME_STACK_EXTRA;
+  if (vm.stack_end - frame->slots < stack_slots) {
+    growStack(stack_slots - (arg_count + 1));
+  }
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
+  return true;
 }
 
 
@@ -246,20 +421,38 @@ static void closeUpvalues(Value* last) {
 /* Macros for `run()`. We unset them after. */
 
 
-#define READ_BYTE() (*frame->ip++)
+#define READ_BYTE() (*ip++)
 // (note: ++ binds tighter than *!)
 
 
+// `run()` caches the current frame's ip in a local so that the compiler
+// can keep it in a register. Anything that can look at frame->ip from
+// outside the loop (runtime errors, pushing a new frame) needs it
+// written back first, and switching frames needs it reloaded.
+#define SAVE_IP() (frame->ip = ip)
+#define LOAD_FRAME() \
+  (frame = &vm.frames[vm.frameCount - 1], ip = frame->ip)
+
+
 // read the next 2 bytes of bytecode as a big-endian 16-bit int
 #define READ_SHORT() \
-  (frame->ip += 2, (uint16_t)(frame->ip[-2] << 8) | frame->ip[-1])
+  (ip += 2, (uint16_t)(ip[-2] << 8) | ip[-1])
 // (recall that the comma operator throws away the LHS of an expression)
 
 
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
 
 
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+// The operand of a _LONG opcode (see chunk.h): 3 bytes, high byte first.
+#define READ_UINT24() \
+  (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT_LONG() \
+  (frame->closure->function->chunk.constants.values[READ_UINT24()])
+
+// For opcodes that share a body with their _LONG version: read the
+// operand in whichever form the opcode we just dispatched on uses.
+#define READ_INDEX(short_op) \
+  (ip[-1] == (short_op) ? READ_BYTE() : READ_UINT24())
 
 
 // Expand a C binary op into a stack operation.
@@ -274,7 +467,8 @@ static void closeUpvalues(Value* last) {
 // itself is buggy.
 #define C_BINARY_NUMERIC_OP(valueType, op)	\
   do { \
-    if (!IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) { \
+    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+      SAVE_IP(); \
       runtimeError("Operands must be numbers."); \
       return INTERPRET_RUNTIME_ERROR; \
     } \
@@ -284,249 +478,139 @@ static void closeUpvalues(Value* last) {
   } while (false)
 
 
-// (recall static means private, loosely speaking)
-static InterpretResult run() {
+// Quickening: rewrite the instruction we're executing into a version
+// specialized for the operand types we just saw. The generic arithmetic
+// and comparison ops do this each time they succeed, so a site whose
+// types never change only pays for the generic type checks once.
+//
+// The specialized ops still check their operands (much more cheaply, and
+// without any string handling); on a miss they DEOPTIMIZE by rewriting
+// the site back to the generic op and re-running it.
+//
+// Both rely on the opcode being at ip[-1], which holds for all of the
+// quickened ops because they have no operand bytes.
+#define QUICKEN(op) (ip[-1] = (op), vm.quickenedSites++)
+#define DEOPTIMIZE(op) (*--ip = (op), vm.deoptimizedSites++)
 
-  // Grab the top frame.
-  //
-  // All locals are looked up relative to its frame offset,
-  // and ip is now tracked per-frame.
-  CallFrame* frame = &vm.frames[vm.frameCount - 1];
 
-  for (;;) {
-    #ifdef DEBUG_TRACE_EXECUTION
-    printf("trace:          stack: { ");
-    for(Value* slot = vm.stack; slot < vm.stack_top; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf(" }\n");
-    disassembleInstruction("trace:",
-			   &frame->closure->function->chunk,
-			   (int)(frame->ip - frame->closure->function->chunk.code));
-			   
-    #endif
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-    case OP_CONSTANT: {
-      Value constant = READ_CONSTANT();
-      push(constant);
-      break;
-    }
-    case OP_NIL:
-      push(NIL_VAL); break;
-    case OP_FALSE:
-      push(BOOL_VAL(false)); break;
-    case OP_TRUE:
-      push(BOOL_VAL(true)); break;
-    case OP_ADD: {
-      // Unlike most other ops, OP_ADD is polymorphic over numbers and strings
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-	// Note: we cannot pop these and then pass them to concatenateStrings,
-	// because the GC could be triggered when we ALLOCATE the new string
-	// and that could invalidate them. Hence the peek / pop bracketing.
-	Value right = peek(0);
-	Value left = peek(1);
-	Value concatenated = concatenateStrings(left, right);
-	pop();
-	pop();
-	push(concatenated);
-      } else {
-	C_BINARY_NUMERIC_OP(NUMBER_VAL, +);
-      }
-      break;
-    }
-    case OP_SUBTRACT:
-      C_BINARY_NUMERIC_OP(NUMBER_VAL, -); break;
-    case OP_MULTIPLY:
-      C_BINARY_NUMERIC_OP(NUMBER_VAL, *); break;
-    case OP_DIVIDE:
-      C_BINARY_NUMERIC_OP(NUMBER_VAL, /); break;
-    case OP_EQUAL:
-      push(BOOL_VAL(valueEqual(pop(), pop()))); break;
-    case OP_LESS:
-      C_BINARY_NUMERIC_OP(BOOL_VAL, <); break;
-    case OP_GREATER:
-      C_BINARY_NUMERIC_OP(BOOL_VAL, >); break;
-    case OP_NEGATE:
-      if (!IS_NUMBER(peek(0))) {
-	runtimeError("Operand to negation must be a number.");
-	return INTERPRET_RUNTIME_ERROR;
-      }
-      push(NUMBER_VAL(-AS_NUMBER(pop())));
-      break;
-    case OP_NOT:
-      push(BOOL_VAL(valueFalsey(pop()) ? true : false));
-      break;
-    case OP_PRINT: {
-      printValue(pop());
-      printf("\n");
-      break;
-    }
-    case OP_POP: {
-      pop();
-      break;
-    }
-    case OP_DEFINE_GLOBAL: {
-      ObjString* name = READ_STRING();
-      // Why do we peek and only then pop?
-      //
-      // Any time a value is ephemeral, i.e. used in the interpreter
-      // loop (so any operation that consumes values), we can pop
-      // freely. But if the value we are popping will continue to be live
-      // in the program we have to be careful in case GC is triggered.
-      //
-      // As a result, we need to make sure the value is in globals *before*
-      // we remove it from the stack since the GC will check both places
-      // but it can't check values that are only accessible from raw C code.
-      tableSet(&vm.globals, name, peek(0));
-      pop();
-      break;
-    }
-    case OP_GET_GLOBAL: {
-      ObjString* name = READ_STRING();
-      Value value;
-      if (!tableGet(&vm.globals, name, &value)) {
-	runtimeError("Undefined variable '%s'.", name->chars);
-	return INTERPRET_RUNTIME_ERROR;
-      }
-      push(value);
-      break;
-    }
-    case OP_SET_GLOBAL: {
-      ObjString* name = READ_STRING();
-      if (tableSet(&vm.globals, name, peek(0))) {
-	// Oops - we set a variable that wasn't declared!
-	tableDelete(&vm.globals, name);
-	runtimeError("Undefined variable '%s'.", name->chars);
-	return INTERPRET_RUNTIME_ERROR;
-      }
-      break;
-    }
-    case OP_SET_LOCAL: {
-      // One thing that seems weird here is that we never allocate a
-      // slot for any opcode. That's because there *is* no opcode for
-      // actually defining a local - we just push the value ot the stack!
-      //
-      // This opcode is only used when setting an already-existant local.
-      uint8_t slot = READ_BYTE();
-      frame->slots[slot] = peek(0);
-      break;
-    }
-    case OP_GET_LOCAL: {
-      uint8_t slot = READ_BYTE();
-      push(frame->slots[slot]);
-      break;
-    }
-    case OP_SET_UPVALUE: {
-      uint8_t upvalue_slot = READ_BYTE();
-      Value* location = frame->closure->upvalues[upvalue_slot]->location;
-      *location = peek(0);
-      break;
-    }
-    case OP_GET_UPVALUE: {
-      uint8_t upvalue_slot = READ_BYTE();
-      Value* location = frame->closure->upvalues[upvalue_slot]->location;
-      push(*location);
-      break;
-    }
-    case OP_CLOSE_UPVALUE: {
-      closeUpvalues(vm.stack_top - 1);
-      pop();
-      break;
-    }
-    case OP_RETURN: {
-      // The result is on top of the stack. Get it, then reset frame.
-      //
-      // Note that we need to be careful of the gc here!
-      // None of these operations can call ALLOCATE, so it's okay to
-      // delay the push.
-      Value result = pop();
-      // Close all the open upvalues pointing into the current stack
-      // frame, then go ahead and remove the stack frame (exiting if
-      // we're already at the top level).
-      closeUpvalues(frame->slots);
-      vm.frameCount--;
-      if (vm.frameCount == 0) {
-        return INTERPRET_OK;
-      }
-      // reset the stack top: next free slot should be
-      // where the function was before. Push the return value there.
-      vm.stack_top = frame->slots;
-      push(result);
-      // reset the current frame in run()
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
-    }
-    case OP_JUMP: {
-      uint16_t offset = READ_SHORT();
-      frame->ip += offset;
-      break;
-    }
-    case OP_LOOP: {
-      uint16_t offset = READ_SHORT();
-      frame->ip -= offset;
-      break;
-    }
-    case OP_JUMP_IF_FALSE: {
-      uint16_t offset = READ_SHORT();
-      // NOTE: the compiler is responsible for popping this if
-      // necessary; we retain it here because logical operators will
-      // want it.
-      if (valueFalsey(peek(0))) {
-	frame->ip += offset;
-      }
-      break;
-    }
-    case OP_CLOSURE: {
-      // this stores only the static data (bytecode + constants + name)
-      ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-      ObjClosure* closure = newClosure(function);
-      printf("         ... allocated a closure %p in OP_CLOSURE", closure);
-      // Note: we must push the closure (so that it's in GC roots)
-      // *before* we allocate upvalues since that could trigger GC.
-      push(OBJ_VAL(closure));
-      for (int i = 0; i < closure->upvalueCount; i++) {
-	uint8_t isLocal = READ_BYTE();
-	uint8_t index = READ_BYTE();
-	// If isLocal, the capture is one layer up (i.e. the current frame)
-	// and we may actually need to create an upvalue.
-	//
-	// Otherwise it's somewhere further up the call stack, and we want
-	// to get the upvalue pointer from the current frame (they will be
-	// tracked all the way to whatever scope the upvalue lives in,
-	// across all intermediate frames).
-	if (isLocal) {
-	  closure->upvalues[i] = captureUpvalue(frame->slots + index);
-	} else {
-	  closure->upvalues[i] = frame->closure->upvalues[index];
-	}
-      }
-      break;
-    }
-    case OP_CALL: {
-      uint8_t arg_count = READ_BYTE();
-      // Set up the call. This can fail (e.g. if the function is not
-      // callable, if arg counts are mismatched). If it *is* successful,
-      // it will append a frame to vm.frames and we then need to
-      // bump the local frame in the `run()` loop.
-      if (!callValue(peek(arg_count), arg_count)) {
-	return INTERPRET_RUNTIME_ERROR;
-      }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
-    }
+// The body of a quickened numeric op: check operand types (deoptimizing
+// to `generic` on a miss), then operate on the stack in place.
+//
+// Note this isn't wrapped in `do { ... } while (false)` because it may
+// DISPATCH(), see the dispatch macros below.
+#define QUICK_NUMERIC_OP(valueType, op, generic) \
+  { \
+    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+      DEOPTIMIZE(generic); \
+      DISPATCH(); \
+    } \
+    double b = AS_NUMBER(vm.stack_top[-1]); \
+    double a = AS_NUMBER(vm.stack_top[-2]); \
+    vm.stack_top[-2] = valueType(a op b); \
+    vm.stack_top--; \
+  }
+
+
+// Dynamic opcode-pair counts for --stats: opcodePairCounts[a][b] is the
+// number of times opcode b executed immediately after opcode a. This is
+// what we used to pick superinstructions.
+static uint64_t opcodePairCounts[UINT8_COUNT][UINT8_COUNT];
+static int previousOpcode = -1;
+
+
+// Per-instruction hook for the instrumented copy of the interpreter loop,
+// which runs whenever --trace or --stats is on.
+static void traceExecution(CallFrame* frame, uint8_t* ip) {
+  if (debugPrintStats) {
+    if (previousOpcode != -1) {
+      opcodePairCounts[previousOpcode][*ip]++;
     }
+    previousOpcode = *ip;
+  }
+  if (!debugTraceExecution) {
+    return;
+  }
+  printf("trace:          stack: { ");
+  for(Value* slot = vm.stack; slot < vm.stack_top; slot++) {
+    printf("[ ");
+    printValue(*slot);
+    printf(" ]");
   }
+  printf(" }\n");
+  disassembleInstruction("trace:",
+			 &frame->closure->function->chunk,
+			 (int)(ip - frame->closure->function->chunk.code));
 }
 
+
+// `tracing` is a compile-time constant in each copy of the interpreter
+// loop (see vm_run.h), so without --trace / --stats this is just READ_BYTE().
+#define NEXT_OPCODE() \
+  ((tracing ? traceExecution(frame, ip) : (void)0), READ_BYTE())
+
+
+// Dispatch macros. The opcode bodies in `run()` are written once and
+// expanded into one of two engines:
+//
+// - Threaded dispatch (the default on GCC / Clang) uses the "labels as
+//   values" extension: every opcode body ends with its own indirect
+//   `goto` through `dispatchTable`. Because each opcode has a separate
+//   jump site, the branch predictor can learn opcode-pair patterns
+//   (e.g. OP_GET_LOCAL is usually followed by OP_CONSTANT in a loop
+//   header) instead of funneling everything through one jump.
+//
+// - Switch dispatch is a plain `for (;;) switch` loop, which works on
+//   any C compiler.
+//
+// Note that DISPATCH() has to be a bare statement rather than a
+// `do { ... } while (false)` block: in the switch engine it expands
+// to `continue`, which would otherwise apply to the wrapper loop.
+//
+// FALLTHROUGH() marks an opcode that runs on into the next one. Only
+// the switch engine needs it (for -Wimplicit-fallthrough); in the
+// threaded engine OPCODE() is a plain label, which the attribute can't
+// precede.
+#ifdef USE_THREADED_DISPATCH
+#define DISPATCH_LOOP DISPATCH();
+#define OPCODE(op) label_##op
+#define DISPATCH() goto *dispatchTable[NEXT_OPCODE()]
+#define FALLTHROUGH()
+#else
+#define DISPATCH_LOOP for (;;) switch (NEXT_OPCODE())
+#define OPCODE(op) case op
+#define DISPATCH() continue
+#define FALLTHROUGH() __attribute__((fallthrough))
+#endif
+
+
+// Stamp out the interpreter loop twice, see vm_run.h.
+#define RUN_NAME run
+#define RUN_TRACING false
+#include "vm_run.h"
+
+#define RUN_NAME runTraced
+#define RUN_TRACING true
+#include "vm_run.h"
+
+
 /* unset the macros that are for use in `run` */
-#undef READ_STRING
 #undef READ_CONSTANT
+#undef READ_UINT24
+#undef READ_CONSTANT_LONG
+#undef READ_INDEX
 #undef READ_BYTE
 #undef READ_SHORT
+#undef SAVE_IP
+#undef LOAD_FRAME
 #undef C_BINARY_NUMERIC_OP
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef QUICK_NUMERIC_OP
+#undef NEXT_OPCODE
+#undef DISPATCH_LOOP
+#undef OPCODE
+#undef DISPATCH
+#undef FALLTHROUGH
 
 
 InterpretResult interpret(const char* source) {
@@ -534,7 +618,11 @@ InterpretResult interpret(const char* source) {
   if (function == NULL) {
     return INTERPRET_COMPILE_ERROR;
   }
+  return interpretFunction(function);
+}
+
 
+InterpretResult interpretFunction(ObjFunction* function) {
   // At this point, there are no compiler GC roots, and
   // `function` is not protected. But `newClosure` will
   // call ALLOCATE which could trigger a GC.
@@ -547,26 +635,77 @@ InterpretResult interpret(const char* source) {
   pop();
   push(OBJ_VAL(top_level));
 
+  // The script's frame starts at its closure, just like a call.
+  Value* slots = vm.stack_top - 1;
+  if (!reserveFrame(slots, function->maxStack + FRAME_STACK_EXTRA)) {
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  // (reserveFrame may have moved the stack)
   CallFrame* frame = &vm.frames[vm.frameCount++];
   frame->closure = top_level;
   frame->ip = function->chunk.code;
-  frame->slots = vm.stack;
+  frame->slots = vm.stack_top - 1;
+  frame->openUpvalueCount = 0;
 
-  return run();
+  return (debugTraceExecution || debugPrintStats) ? runTraced() : run();
 }
 
 
 void freeObjects() {
-  Obj* object = vm.objects;
-  while (object != NULL) {
-    Obj* next = object->next;
-    freeObject(object);
-    object = next;
+  heapFreeAll();
+}
+
+#define STATS_TOP_PAIRS 12
+
+
+void vmPrintStats() {
+  fprintf(stderr, "quickening: %zu sites quickened, %zu deoptimized\n",
+	  vm.quickenedSites, vm.deoptimizedSites);
+  printGCStats();
+
+  // Report the most frequent opcode pairs, along with their share of all
+  // executed pairs, by insertion into a small sorted array.
+  uint64_t total = 0;
+  uint64_t topCounts[STATS_TOP_PAIRS] = {0};
+  int topPairs[STATS_TOP_PAIRS] = {0};  // a * UINT8_COUNT + b
+  for (int a = 0; a < UINT8_COUNT; a++) {
+    for (int b = 0; b < UINT8_COUNT; b++) {
+      uint64_t count = opcodePairCounts[a][b];
+      total += count;
+      int i = STATS_TOP_PAIRS;
+      while (i > 0 && topCounts[i - 1] < count) {
+	if (i < STATS_TOP_PAIRS) {
+	  topCounts[i] = topCounts[i - 1];
+	  topPairs[i] = topPairs[i - 1];
+	}
+	i--;
+      }
+      if (i < STATS_TOP_PAIRS) {
+	topCounts[i] = count;
+	topPairs[i] = a * UINT8_COUNT + b;
+      }
+    }
+  }
+  fprintf(stderr, "opcode pairs: %llu executed, most frequent:\n",
+	  (unsigned long long)total);
+  for (int i = 0; i < STATS_TOP_PAIRS && topCounts[i] > 0; i++) {
+    fprintf(stderr, "  %-28s %-28s %12llu  %5.1f%%\n",
+	    opcodeName(topPairs[i] / UINT8_COUNT),
+	    opcodeName(topPairs[i] % UINT8_COUNT),
+	    (unsigned long long)topCounts[i], 100.0 * topCounts[i] / total);
   }
 }
 
+
 void freeVM() {
   freeObjects();
-  freeTable(&vm.globals);
+  FREE_ARRAY(Global, vm.globals, vm.globalCapacity);
+  freeTable(&vm.globalSlots);
   freeTable(&vm.strings);
+  free(vm.frames);
+  free(vm.stack);
+  free(vm.openUpvalues);
+  vm.frames = NULL;
+  vm.stack = NULL;
+  vm.openUpvalues = NULL;
 }
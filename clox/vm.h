@@ -7,44 +7,80 @@
 #include "table.h"
 
 
-#define FRAMES_MAX 64
-// We get UINT8_COUNT locals *per frame*, because
-// locals are looked up using a uint8_t offset against
-// each frame pointer.
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
-// technically we don't actually have robust checking against
-// too many temporary variables, it is *possible* to stack overflow
-// (see the note in Section 24.3 about temporaries overflowing)
+// The frame and value stacks start small and grow as calls need them
+// (see reserveFrame in vm.c). FRAMES_MAX is just there to turn runaway
+// recursion into a runtime error rather than eat all our memory.
+#define FRAMES_MAX (1024 * 1024)
+#define FRAMES_INITIAL 16
+#define STACK_INITIAL 1024
+// A call makes sure there is room for its function's maxStack slots
+// (which the compiler works out, temporaries included), plus this many
+// for the values the vm itself pushes to keep a new object reachable
+// while it allocates (see internString).
+#define FRAME_STACK_EXTRA 1
 
 typedef struct {
   ObjClosure* closure;
   uint8_t* ip;
   Value* slots;  // frame pointer into vm.stack
+  // How many of this frame's slots have an open upvalue, so that
+  // returning from a frame with none doesn't have to look.
+  int openUpvalueCount;
 } CallFrame;
 
 
+// Globals are resolved to slots at compile time (see vmGlobalSlot), so
+// at runtime a global access is just an index into vm.globals. A slot
+// exists as soon as the compiler sees the name, but the variable is
+// undefined until an OP_DEFINE_GLOBAL runs.
+typedef struct {
+  ObjString* name;  // kept for error messages and the disassembler
+  Value value;
+  bool isDefined;
+} Global;
+
+
 typedef struct {
   // frame stack
-  CallFrame frames[FRAMES_MAX];
+  CallFrame* frames;
   int frameCount;
-  // value stack
-  Value stack[STACK_MAX];
+  int frameCapacity;
+  // value stack; growing it moves it, so anything pointing into it has
+  // to be fixed up (see growStack in vm.c)
+  Value* stack;
   Value* stack_top;
-  // open upvalues: captures currently pointing at the stack
-  ObjUpvalue* openUpvalues;
-  // heap data
-  Obj* objects;
+  Value* stack_end;
+  // open upvalues: captures currently pointing at the stack, indexed
+  // by stack slot (NULL for a slot nothing has captured). It has the
+  // same capacity as the value stack.
+  ObjUpvalue** openUpvalues;
+  // heap data (the objects themselves live in heap.c)
   Table strings;
-  Table globals;
+  // global variables: slots, plus a name -> slot index lookup
+  Global* globals;
+  int globalCount;
+  int globalCapacity;
+  Table globalSlots;
+  // quickening counters (see QUICKEN / DEOPTIMIZE in vm.c)
+  size_t quickenedSites;
+  size_t deoptimizedSites;
 } VM;
 
 
 // This is exposed so that object.c can use it.
-void vmInsertObjectIntoHeap(Obj *object);
 bool vmAddInternedString(ObjString* string);
 ObjString* vmFindInternedString(const char* chars,
    			        int length, uint32_t hash);
 
+// These are exposed for the compiler and disassembler.
+//
+// Look up the slot for a global by name, creating an (undefined) one if
+// this is the first time we've seen the name. Slots persist across calls
+// to `interpret`, so names keep their meaning from one REPL line to the next.
+int vmGlobalSlot(ObjString* name);
+ObjString* vmGlobalName(int slot);
+int vmGlobalCount();
+
 
 
 typedef enum {
@@ -58,9 +94,17 @@ void initVM();
 // GC hooks (driven by memory.h code)
 void markVmRoots();
 void sweepVmObjects();
+// Just the first part of sweepVmObjects: delete the interned strings
+// that aren't marked. The incremental collector sweeps the heap itself.
+void sweepVmStrings();
+void sweepVmNursery();
 
 InterpretResult interpret(const char* source);
 
+// Run an already-compiled top-level function (e.g. from the bytecode
+// cache, see cache.h).
+InterpretResult interpretFunction(ObjFunction* function);
+
 void push(Value value);
 
 Value peek(int distance);
@@ -69,4 +113,7 @@ Value pop();
 
 void freeVM();
 
+// Print counters collected while running (for --stats).
+void vmPrintStats();
+
 #endif
@@ -0,0 +1,404 @@
+/* The body of the interpreter loop, as a "template" for vm.c.
+
+   This is deliberately not a normal header (there's no include guard):
+   vm.c includes it once per variant of `run()` it wants, after defining
+     - RUN_NAME, the name of the function to define
+     - RUN_TRACING, `true` or `false`
+
+   We do this so that `--trace` (and the opcode counting for `--stats`)
+   costs nothing when it's off. Rather than testing a flag on every
+   instruction, we get two copies of the loop and `tracing` is a
+   compile-time constant in each, so the compiler drops all the trace
+   code from the non-tracing one. (We can't get the same
+   effect from an inlined helper, because gcc refuses to inline functions
+   that use computed gotos.)
+
+   All of the READ_* / DISPATCH macros it uses are defined in vm.c.
+*/
+
+
+// (recall static means private, loosely speaking)
+static InterpretResult RUN_NAME() {
+  const bool tracing = RUN_TRACING;
+
+  // Grab the top frame.
+  //
+  // All locals are looked up relative to its frame offset,
+  // and ip is now tracked per-frame.
+  CallFrame* frame;
+  uint8_t* ip;
+  LOAD_FRAME();
+
+#ifdef USE_THREADED_DISPATCH
+  // One label per opcode; this must be kept in sync with OpCode.
+  static void* dispatchTable[] = {
+    [OP_ADD] = &&label_OP_ADD,
+    [OP_ADD_LOCALS] = &&label_OP_ADD_LOCALS,
+    [OP_ADD_NUM] = &&label_OP_ADD_NUM,
+    [OP_ADD_STR] = &&label_OP_ADD_STR,
+    [OP_CALL] = &&label_OP_CALL,
+    [OP_CONSTANT] = &&label_OP_CONSTANT,
+    [OP_CONSTANT_LONG] = &&label_OP_CONSTANT_LONG,
+    [OP_CLOSURE] = &&label_OP_CLOSURE,
+    [OP_CLOSURE_LONG] = &&label_OP_CLOSURE_LONG,
+    [OP_CLOSE_UPVALUE] = &&label_OP_CLOSE_UPVALUE,
+    [OP_DIVIDE] = &&label_OP_DIVIDE,
+    [OP_DIVIDE_NUM] = &&label_OP_DIVIDE_NUM,
+    [OP_DEFINE_GLOBAL] = &&label_OP_DEFINE_GLOBAL,
+    [OP_DEFINE_GLOBAL_LONG] = &&label_OP_DEFINE_GLOBAL_LONG,
+    [OP_EQUAL] = &&label_OP_EQUAL,
+    [OP_FALSE] = &&label_OP_FALSE,
+    [OP_JUMP] = &&label_OP_JUMP,
+    [OP_JUMP_IF_FALSE] = &&label_OP_JUMP_IF_FALSE,
+    [OP_JUMP_LOCAL_NOT_LESS_CONST] = &&label_OP_JUMP_LOCAL_NOT_LESS_CONST,
+    [OP_GET_GLOBAL] = &&label_OP_GET_GLOBAL,
+    [OP_GET_GLOBAL_LONG] = &&label_OP_GET_GLOBAL_LONG,
+    [OP_GET_LOCAL] = &&label_OP_GET_LOCAL,
+    [OP_GET_UPVALUE] = &&label_OP_GET_UPVALUE,
+    [OP_GREATER] = &&label_OP_GREATER,
+    [OP_GREATER_NUM] = &&label_OP_GREATER_NUM,
+    [OP_LESS] = &&label_OP_LESS,
+    [OP_LESS_NUM] = &&label_OP_LESS_NUM,
+    [OP_LOOP] = &&label_OP_LOOP,
+    [OP_MULTIPLY] = &&label_OP_MULTIPLY,
+    [OP_MULTIPLY_NUM] = &&label_OP_MULTIPLY_NUM,
+    [OP_NEGATE] = &&label_OP_NEGATE,
+    [OP_NIL] = &&label_OP_NIL,
+    [OP_NOT] = &&label_OP_NOT,
+    [OP_POP] = &&label_OP_POP,
+    [OP_PRINT] = &&label_OP_PRINT,
+    [OP_RETURN] = &&label_OP_RETURN,
+    [OP_RETURN_CONSTANT] = &&label_OP_RETURN_CONSTANT,
+    [OP_SET_GLOBAL] = &&label_OP_SET_GLOBAL,
+    [OP_SET_GLOBAL_LONG] = &&label_OP_SET_GLOBAL_LONG,
+    [OP_SET_LOCAL] = &&label_OP_SET_LOCAL,
+    [OP_SET_LOCAL_POP] = &&label_OP_SET_LOCAL_POP,
+    [OP_SET_UPVALUE] = &&label_OP_SET_UPVALUE,
+    [OP_SUBTRACT] = &&label_OP_SUBTRACT,
+    [OP_SUBTRACT_NUM] = &&label_OP_SUBTRACT_NUM,
+    [OP_TAIL_CALL] = &&label_OP_TAIL_CALL,
+    [OP_TRUE] = &&label_OP_TRUE,
+  };
+#endif
+
+  DISPATCH_LOOP {
+    OPCODE(OP_CONSTANT): {
+      Value constant = READ_CONSTANT();
+      push(constant);
+      DISPATCH();
+    }
+    OPCODE(OP_CONSTANT_LONG): {
+      Value constant = READ_CONSTANT_LONG();
+      push(constant);
+      DISPATCH();
+    }
+    OPCODE(OP_NIL):
+      push(NIL_VAL); DISPATCH();
+    OPCODE(OP_FALSE):
+      push(BOOL_VAL(false)); DISPATCH();
+    OPCODE(OP_TRUE):
+      push(BOOL_VAL(true)); DISPATCH();
+    OPCODE(OP_ADD): {
+      // Unlike most other ops, OP_ADD is polymorphic over numbers and strings
+      if (isAnyString(peek(0)) && isAnyString(peek(1))) {
+	QUICKEN(OP_ADD_STR);
+	// Note: we cannot pop these and then pass them to concatenateStrings,
+	// because the GC could be triggered when we ALLOCATE the new string
+	// and that could invalidate them. Hence the peek / pop bracketing.
+	Value right = peek(0);
+	Value left = peek(1);
+	Value concatenated = concatenateStrings(left, right);
+	pop();
+	pop();
+	push(concatenated);
+      } else {
+	C_BINARY_NUMERIC_OP(NUMBER_VAL, +);
+	QUICKEN(OP_ADD_NUM);
+      }
+      DISPATCH();
+    }
+    OPCODE(OP_ADD_NUM):
+      QUICK_NUMERIC_OP(NUMBER_VAL, +, OP_ADD); DISPATCH();
+    OPCODE(OP_ADD_STR): {
+      if (!isAnyString(peek(0)) || !isAnyString(peek(1))) {
+	DEOPTIMIZE(OP_ADD);
+	DISPATCH();
+      }
+      Value concatenated = concatenateStrings(peek(1), peek(0));
+      pop();
+      pop();
+      push(concatenated);
+      DISPATCH();
+    }
+    OPCODE(OP_ADD_LOCALS): {
+      // Superinstruction for `a + b` on two locals. The operands live in
+      // stack slots, so they stay reachable if concatenating allocates.
+      Value left = frame->slots[READ_BYTE()];
+      Value right = frame->slots[READ_BYTE()];
+      if (IS_NUMBER(left) && IS_NUMBER(right)) {
+	push(NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right)));
+      } else if (isAnyString(left) && isAnyString(right)) {
+	push(concatenateStrings(left, right));
+      } else {
+	SAVE_IP();
+	runtimeError("Operands must be numbers.");
+	return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    OPCODE(OP_SUBTRACT):
+      C_BINARY_NUMERIC_OP(NUMBER_VAL, -); QUICKEN(OP_SUBTRACT_NUM); DISPATCH();
+    OPCODE(OP_SUBTRACT_NUM):
+      QUICK_NUMERIC_OP(NUMBER_VAL, -, OP_SUBTRACT); DISPATCH();
+    OPCODE(OP_MULTIPLY):
+      C_BINARY_NUMERIC_OP(NUMBER_VAL, *); QUICKEN(OP_MULTIPLY_NUM); DISPATCH();
+    OPCODE(OP_MULTIPLY_NUM):
+      QUICK_NUMERIC_OP(NUMBER_VAL, *, OP_MULTIPLY); DISPATCH();
+    OPCODE(OP_DIVIDE):
+      C_BINARY_NUMERIC_OP(NUMBER_VAL, /); QUICKEN(OP_DIVIDE_NUM); DISPATCH();
+    OPCODE(OP_DIVIDE_NUM):
+      QUICK_NUMERIC_OP(NUMBER_VAL, /, OP_DIVIDE); DISPATCH();
+    OPCODE(OP_EQUAL): {
+      // Comparing ropes flattens them, which allocates, so the operands
+      // have to stay on the stack until we're done.
+      bool equal = valueEqual(peek(1), peek(0));
+      pop();
+      pop();
+      push(BOOL_VAL(equal));
+      DISPATCH();
+    }
+    OPCODE(OP_LESS):
+      C_BINARY_NUMERIC_OP(BOOL_VAL, <); QUICKEN(OP_LESS_NUM); DISPATCH();
+    OPCODE(OP_LESS_NUM):
+      QUICK_NUMERIC_OP(BOOL_VAL, <, OP_LESS); DISPATCH();
+    OPCODE(OP_GREATER):
+      C_BINARY_NUMERIC_OP(BOOL_VAL, >); QUICKEN(OP_GREATER_NUM); DISPATCH();
+    OPCODE(OP_GREATER_NUM):
+      QUICK_NUMERIC_OP(BOOL_VAL, >, OP_GREATER); DISPATCH();
+    OPCODE(OP_NEGATE):
+      if (!IS_NUMBER(peek(0))) {
+	SAVE_IP();
+	runtimeError("Operand to negation must be a number.");
+	return INTERPRET_RUNTIME_ERROR;
+      }
+      push(NUMBER_VAL(-AS_NUMBER(pop())));
+      DISPATCH();
+    OPCODE(OP_NOT):
+      push(BOOL_VAL(valueFalsey(pop()) ? true : false));
+      DISPATCH();
+    OPCODE(OP_PRINT): {
+      printValue(pop());
+      printf("\n");
+      DISPATCH();
+    }
+    OPCODE(OP_POP): {
+      pop();
+      DISPATCH();
+    }
+    OPCODE(OP_DEFINE_GLOBAL_LONG):
+    OPCODE(OP_DEFINE_GLOBAL): {
+      // Globals are slots that always exist (the compiler created them),
+      // so defining one can't allocate and it's fine to pop right away.
+      Global* global = &vm.globals[READ_INDEX(OP_DEFINE_GLOBAL)];
+      global->value = pop();
+      global->isDefined = true;
+      DISPATCH();
+    }
+    OPCODE(OP_GET_GLOBAL_LONG):
+    OPCODE(OP_GET_GLOBAL): {
+      Global* global = &vm.globals[READ_INDEX(OP_GET_GLOBAL)];
+      if (!global->isDefined) {
+	SAVE_IP();
+	runtimeError("Undefined variable '%s'.", global->name->chars);
+	return INTERPRET_RUNTIME_ERROR;
+      }
+      push(global->value);
+      DISPATCH();
+    }
+    OPCODE(OP_SET_GLOBAL_LONG):
+    OPCODE(OP_SET_GLOBAL): {
+      Global* global = &vm.globals[READ_INDEX(OP_SET_GLOBAL)];
+      if (!global->isDefined) {
+	// Oops - we set a variable that wasn't declared!
+	SAVE_IP();
+	runtimeError("Undefined variable '%s'.", global->name->chars);
+	return INTERPRET_RUNTIME_ERROR;
+      }
+      global->value = peek(0);
+      DISPATCH();
+    }
+    OPCODE(OP_SET_LOCAL_POP): {
+      uint8_t slot = READ_BYTE();
+      frame->slots[slot] = pop();
+      DISPATCH();
+    }
+    OPCODE(OP_SET_LOCAL): {
+      // One thing that seems weird here is that we never allocate a
+      // slot for any opcode. That's because there *is* no opcode for
+      // actually defining a local - we just push the value ot the stack!
+      //
+      // This opcode is only used when setting an already-existant local.
+      uint8_t slot = READ_BYTE();
+      frame->slots[slot] = peek(0);
+      DISPATCH();
+    }
+    OPCODE(OP_GET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      push(frame->slots[slot]);
+      DISPATCH();
+    }
+    OPCODE(OP_SET_UPVALUE): {
+      uint8_t upvalue_slot = READ_BYTE();
+      // (only variables captured through an ObjUpvalue can be assigned)
+      ObjUpvalue* upvalue = AS_UPVALUE(frame->closure->upvalues[upvalue_slot]);
+      *upvalue->location = peek(0);
+      // Only needed if it's closed, but it's harmless otherwise.
+      writeBarrier((Obj*)upvalue, peek(0));
+      DISPATCH();
+    }
+    OPCODE(OP_GET_UPVALUE): {
+      uint8_t upvalue_slot = READ_BYTE();
+      Value value = frame->closure->upvalues[upvalue_slot];
+      if (IS_UPVALUE(value)) {
+	value = *AS_UPVALUE(value)->location;
+      }
+      push(value);
+      DISPATCH();
+    }
+    OPCODE(OP_CLOSE_UPVALUE): {
+      closeUpvalues(frame, vm.stack_top - 1);
+      pop();
+      DISPATCH();
+    }
+    OPCODE(OP_RETURN_CONSTANT):
+      push(READ_CONSTANT());
+      FALLTHROUGH();
+    OPCODE(OP_RETURN): {
+      // The result is on top of the stack. Get it, then reset frame.
+      //
+      // Note that we need to be careful of the gc here!
+      // None of these operations can call ALLOCATE, so it's okay to
+      // delay the push.
+      Value result = pop();
+      // Close all the open upvalues pointing into the current stack
+      // frame, then go ahead and remove the stack frame (exiting if
+      // we're already at the top level).
+      closeUpvalues(frame, frame->slots);
+      vm.frameCount--;
+      // reset the stack top: next free slot should be
+      // where the function was before.
+      vm.stack_top = frame->slots;
+      if (vm.frameCount == 0) {
+        // Leave the stack empty for the next script (or REPL line).
+        return INTERPRET_OK;
+      }
+      // Push the return value where the function was.
+      push(result);
+      // reset the current frame in run()
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    OPCODE(OP_JUMP): {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    OPCODE(OP_LOOP): {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+      DISPATCH();
+    }
+    OPCODE(OP_JUMP_IF_FALSE): {
+      uint16_t offset = READ_SHORT();
+      // NOTE: the compiler is responsible for popping this if
+      // necessary; we retain it here because logical operators will
+      // want it.
+      if (valueFalsey(peek(0))) {
+	ip += offset;
+      }
+      DISPATCH();
+    }
+    OPCODE(OP_JUMP_LOCAL_NOT_LESS_CONST): {
+      // Superinstruction for `if (local < constant)` and loop headers.
+      // Unlike OP_JUMP_IF_FALSE there's no condition left on the stack.
+      Value left = frame->slots[READ_BYTE()];
+      Value right = READ_CONSTANT();
+      uint16_t offset = READ_SHORT();
+      if (!IS_NUMBER(left) || !IS_NUMBER(right)) {
+	SAVE_IP();
+	runtimeError("Operands must be numbers.");
+	return INTERPRET_RUNTIME_ERROR;
+      }
+      if (!(AS_NUMBER(left) < AS_NUMBER(right))) {
+	ip += offset;
+      }
+      DISPATCH();
+    }
+    OPCODE(OP_CLOSURE_LONG):
+    OPCODE(OP_CLOSURE): {
+      // this stores only the static data (bytecode + constants + name)
+      Value constant = frame->closure->function->chunk.constants.values[READ_INDEX(OP_CLOSURE)];
+      ObjFunction* function = AS_FUNCTION(constant);
+      ObjClosure* closure = newClosure(function);
+      if (tracing && debugTraceExecution) {
+	printf("trace:          allocated closure %p\n", (void*)closure);
+      }
+      // Note: we must push the closure (so that it's in GC roots)
+      // *before* we allocate upvalues since that could trigger GC.
+      push(OBJ_VAL(closure));
+      for (int i = 0; i < closure->upvalueCount; i++) {
+	uint8_t kind = READ_BYTE();
+	uint8_t index = READ_BYTE();
+	// For a local, the capture is one layer up (i.e. the current frame)
+	// and we may actually need to create an upvalue.
+	//
+	// Otherwise it's somewhere further up the call stack, and we want
+	// to get the upvalue from the current frame (they will be tracked
+	// all the way to whatever scope the upvalue lives in, across all
+	// intermediate frames). Copying it works the same whether that's an
+	// ObjUpvalue or a captured value.
+	if (kind == CAPTURE_LOCAL) {
+	  closure->upvalues[i] = OBJ_VAL(captureUpvalue(frame->slots + index));
+	} else if (kind == CAPTURE_LOCAL_VALUE) {
+	  closure->upvalues[i] = frame->slots[index];
+	} else {
+	  closure->upvalues[i] = frame->closure->upvalues[index];
+	}
+	// Capturing allocates, so the closure may be old by now.
+	writeBarrier((Obj*)closure, closure->upvalues[i]);
+      }
+      DISPATCH();
+    }
+    OPCODE(OP_CALL): {
+      uint8_t arg_count = READ_BYTE();
+      // Set up the call. This can fail (e.g. if the function is not
+      // callable, if arg counts are mismatched). If it *is* successful,
+      // it will append a frame to vm.frames and we then need to
+      // bump the local frame in the `run()` loop.
+      SAVE_IP();
+      if (!callValue(peek(arg_count), arg_count)) {
+	return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    OPCODE(OP_TAIL_CALL): {
+      uint8_t arg_count = READ_BYTE();
+      // Like OP_CALL, except that on success the callee is running in
+      // what was our frame, so there's nothing to come back to.
+      SAVE_IP();
+      if (!tailCallValue(peek(arg_count), arg_count)) {
+	return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      DISPATCH();
+    }
+  }
+
+  // (unreachable: every opcode body ends by dispatching or returning)
+  return INTERPRET_RUNTIME_ERROR;
+}
+
+
+#undef RUN_NAME
+#undef RUN_TRACING